@@ -5,21 +5,125 @@
  * Name: mini-project-clock.c
  * Description: 
  * >Timer1 is used in conjunction with 32.768kHz oscillator on board and high-priority interrupts to generate a 1Hz clock for timekeeping
+ *  The Timer1 ISR counts seconds since 00:00:00 01/01/2000 (epoch_secs), which is the only record of the date/time. There are no rollovers for
+ *  the main loop to carry forward: dd/mm/yy hh:mm:ss (MainClock) are worked out from epoch_secs by UpdateMainTime() only when they are
+ *  displayed, and the setting menu works out the date/time it starts from in the same way. The menu sets a shadow of the date/time (menu_time/
+ *  menu_date), which it counts on with the RTC, so the clock never stops while it is being set. When the set mode is left, the change made to
+ *  the shadow is added on to epoch_secs (ShiftEpoch()), which keeps the seconds counted since the shadow was taken & the time into the second
+ *  Once the seconds have been set, the shadow is written to epoch_secs with the current second started afresh in Timer1 (SetEpoch()), so the
+ *  clock reads exactly the seconds shown as the set mode is left, rather than being up to a second out
+ *  MainClock is held in packed BCD (tens in the high nibble, units in the low), so showing a field is only two look-ups in DispNums[]. Normally
+ *  a second has passed since it was last worked out, so the seconds are counted on in BCD, carrying into the minutes & hours. Only at midnight,
+ *  or after the time has jumped (set, or while in standby), is the whole date/time worked out again from epoch_secs. The time at which each alarm is next due is worked
+ *  out in the same units by ScheduleAlarms() whenever the alarms or the time change, and the alarms are kept in a list sorted by that time
+ *  (alarm_order). Each second the ISR only compares epoch_secs with the time of the alarm at the head of the list. A due alarm is latched for
+ *  the main loop to sound, so it can't be missed while the main loop is busy (e.g. in the setting menu)
+ *  Timer1 is never reloaded. It runs free and overflows every 2^15 crystal ticks because the ISR adds TIMER1_HIGH to TMR1H, which leaves the
+ *  ticks counted in TMR1L since the overflow alone, so no time is lost however late the ISR runs. The crystal's error is trimmed out by
+ *  rtc_trim (ppm), which is accumulated a second at a time. Each time it adds up to 256 crystal ticks, one second is shortened/lengthened by 256 ticks
+ *  The main loop only reads epoch_secs through GetEpoch() & writes it through SetEpoch()/ShiftEpoch(). Each time the RTC is changed, rtc_seq is
+ *  counted on after it, and GetEpoch() takes another copy if rtc_seq changed while it was copying (a sequence lock), so reading the time never
+ *  needs interrupts disabling. Nothing else writes the RTC, and only SetEpoch()/ShiftEpoch() hold off Timer1 ISR & the PPS ISR, for the few
+ *  instructions it takes to write epoch_secs (and Timer1, which SetEpoch() stops while it writes it, as it is clocked asynchronously), so the
+ *  PPS ISR never notes a part-written time either
  * 
- * >Timer0 is run from the instruction clock to generate an approximate 1ms delay used for other tasks & millisecond counters such as:
- *      -7-segment display/LEDs multiplexing (happens at around 1ms)
- *      -Millisecond counters for:
- *          >Cycling of display of date/time (ms_count0)
- *          >Debounce delay for push buttons (ms_count1)
- *          >Polling of alarms to check whether they should be sounded (ms_count2)
- *          >Timing of length of alarm tone notes (ms_count3)
+ * >There are MAX_ALARMS alarms, held in the alarms[] table. Each has a time, a date (used only if it is a dated alarm), an on/off flag, a
+ *  weekday repeat mask and the melody it plays. All of them are set by the same code, with the alarm being set chosen in the setting menu:
+ *      -ALARM_SELECT (switches 7 & 6) - PB2/PB1 step forwards/backwards through the alarms. The alarm no. is shown as 'A1'-'A9', then 10-16
+ *      -ALARM_TIME (switch 7) - Sets hh:mm:ss of the alarm. With no other switches set, PB2 switches it on ('on', goes off once) then toggles
+ *       whether it repeats every day ('rP'). PB1 switches it off ('oF')
+ *      -ALARM_DATE (switch 6) - Sets dd/mm/yy hh:mm:ss of the alarm. With no other switches set, PB2/PB1 switch it on/off as a dated alarm
+ *  Alarms which don't repeat switch themselves off when they go off
+ *  The setting menu is a state machine (menu_state) stepped every MENU_POLL_RATE ms by MenuTask(), so the main loop keeps running while it is
+ *  in use. Setting a toggle switch enters its set mode, which flashes the name of the field (or the alarm no.), timed against ms_ticks, then
+ *  shows the value being set. PB2/PB1 step it forwards/backwards every KEY_REPEAT_DELAY ms while held. Alarms due while in the menu sound once
+ *  it has been left
  * 
+ * >CCP5 compares against Timer3 to generate a 1ms tick used for:
+ *      -7-segment display/LEDs multiplexing (one of them every refresh_div ms). The bytes to write to LATF, LATH & LATA for each of the LEDs, U1 &
+ *       U2 are kept ready in frame[], so the ISR only has to index it and write them out. frame[] is only written when what is displayed changes,
+ *       through disp_LEDS/disp_U1/disp_U2. The U1 decimal point (second indicator) is masked in with dp_mask as U1 is written
+ *       The main loop only renders the date/time into them (CurrentDisplay()) when a DIRTY_ flag in disp_dirty says it may have changed: set
+ *       by Timer1 ISR each second, by StepDisplay() when disp_index moves, and when the menu or an alarm has written over the displays
+ *       Each display has a brightness level (0 - BRIGHT_LEVELS). A display which isn't fully on is blanked part-way through its time by CCP3,
+ *       which is set up to compare against Timer3 on_tcy after the tick it was shown on. DimTask sets the levels & refresh rate from DimLevels[]
+ *       & DimRefresh[]: full brightness by day, dimmed between DIM_FROM_HRS & DIM_TO_HRS, and dimmed & refreshed at half the rate after
+ *       DIM_TIMEOUT seconds with no input, to cut the ISR load & current drawn by the displays
+ *      -Counting milliseconds (ms_ticks) for the task scheduler. Periodic tasks are added to the task table with AddTask() and are run from the
+ *       main loop by RunTasks() when they are due, so none of them block the main loop. The tasks are:
+ *          >Cycling of display of date/time (DisplayCycleTask)
+ *          >Stepping the display while PB1/PB2 are held, and acknowledging alarms (ButtonTask)
+ *          >Choosing the brightness of the displays (DimTask)
+ *          >The setting menu (MenuTask)
+ *          >Writing the settings to the EEPROM (SaveStep)
+ *          >Carrying out commands received on the UART (UartTask)
+ *          >Reading the time from the GPS receiver & disciplining the RTC to it (GpsTask)
+ *          >Decoding the radio time code (RadioTask)
+ *      -Sampling & de-bouncing of push buttons PB1/PB2. The debounced state is kept by the ISR, so reading a button never blocks
+ *      -Sampling & filtering the radio time-code receiver's output, and timing its pulses (RadioSample)
+ *      -Timing the length of the note currently being played by the tone generator, and stepping through the alarm melody being played
+ *  Each compare value is added on to the last (TICK_TCY later), so the tick is exactly 1ms however late the ISR runs (e.g. while Timer1 ISR
+ *  or a critical section holds it off). Only when each tick happens jitters, not how many there are
+ * 
+ * >Timer3 is run from the instruction clock as the timebase for CCP4 & CCP5 in compare mode. The CCP4 interrupt toggles the piezo buzzer (RJ6) every
+ *  half-period of the note being played, so alarm tones are generated in the background. The buzzer isn't on a CCP/PWM pin, so the interrupt
+ *  drives it. The next compare value is added on to the last, so the ISR latency doesn't affect the pitch
+ * 
+ * >Power saving. The main loop has nothing to do between interrupts, so after each pass it idles the CPU (PowerSave(POWER_IDLE)) until the next
+ *  one, with the peripherals still running. For battery-backed units (BATTERY_BACKED), after STANDBY_TIMEOUT seconds with no input the clock goes into standby
+ *  (Standby()): the displays/LEDs are blanked, the 1ms tick is stopped and the PIC sleeps with only Timer1 running from its own oscillator
+ *  (asynchronously, so it keeps counting in sleep). It wakes once a second for Timer1 ISR to count the RTC, then goes back to sleep unless
+ *  PB1, a toggle switch or a due alarm needs it. PB2 is on INT0, so it wakes the PIC straight away. PowerSave() returns why the PIC woke
+ *  (WAKE_ flags), set by the ISRs in wake_reason
+ * 
+ * >Persistence. The time, the alarm table & rtc_trim are saved to the data EEPROM, and restored from it at reset (LoadSettings()), so a reset
+ *  or power cut no longer brings the clock back at 00:00:00 01/01/2016 with the alarms off. The EEPROM is divided into EE_SLOTS slots, each
+ *  holding a record (SAVED) & its CRC-16. Each save goes to the slot after the last, so the wear is spread across them, and is stamped with a
+ *  sequence no. At reset each slot's sequence no. is read once, and the newest record whose CRC is good is restored. One torn by a reset part
+ *  way through saving it is passed over for the one before. Saves are written behind: leaving the setting menu (or an alarm switching itself
+ *  off) only brings the next save forward to SAVE_DELAY seconds later, so changes made together are saved together, and otherwise the time is
+ *  saved every SAVE_PERIOD seconds. SaveStep() copies the settings when the save is due, then writes them a byte at a time, leaving out bytes
+ *  the slot already holds, without waiting for each write (about 4ms) to finish. Standby isn't entered part way through a save
+ *  The HLVD interrupts (high priority) as the supply fails, and PowerFail_isr() writes a snapshot of epoch_secs, the time into the second
+ *  (TMR1H) & which alarms are on to the end of the EEPROM, so what has happened since the last save isn't lost. It is only EE_SNAP_SIZE
+ *  bytes, so it is written within (EE_SNAP_SIZE + 1) * 4ms (checked by 'make bench'), which the supply must hold up for. At reset the
+ *  snapshot is restored after the record it follows on from, with DOWNTIME_MS added on as an estimate of the time the clock was stopped for
+ *
+ * >UART commands. EUSART1 (RC6/RC7, 9600 baud 8N1) takes binary commands to get/set the time, get/set an alarm and read the event counters
+ *  (counters[]), so a host can set & check the clock. The low-priority ISR moves each byte received into rx_buf[] and feeds TXREG1 from
+ *  tx_buf[], and UartTask() picks frames out of rx_buf[] and queues the replies, so the main loop never waits on the UART. Frames are:
+ *  UART_SYNC, command, no. of data bytes, data, CRC-16 (low byte first) over the command, length & data. A reply has UART_REPLY ORed into
+ *  the command and a status (STATUS_) before its data. Frames with a bad CRC, or which stop part way through for UART_TIMEOUT ms, are dropped
+ *  without a reply, and a reply with no room in tx_buf[] is dropped, so the host retries on not getting one. In standby the start of a byte
+ *  wakes the PIC (WUE) and it leaves standby, but that byte is lost, so the host sends a byte other than UART_SYNC before a command.
+ *  sim/clockctl.c is a host client
+ *
+ * >GPS time discipline. A GPS receiver's NMEA output goes to EUSART2 (RG2) and its PPS (a rising edge at the start of each UTC second) to
+ *  INT1 (RB1). The PPS ISR (high priority) notes where Timer1 is in the second, and the $--RMC/$--ZDA sentence which follows names the
+ *  second that PPS started. GpsTask() parses the sentences a character at a time as they come in, with nothing buffered but the field being
+ *  read, and pairs each valid one (RMC status 'A', checksum good) with the PPS before it. The RTC is only stepped when it is a whole second
+ *  out or more than GPS_STEP_TICKS off (at first, or after a long outage): GpsStep() then sets it to the second the PPS started plus the
+ *  crystal ticks Timer1 has counted since, so the step is exact to a tick or so without the PPS ISR having to write the RTC.
+ *  Otherwise it is slewed: a proportional-integral loop sets rtc_trim from the offset, so Timer1 is brought into line over a few minutes
+ *  and the integral is left as the estimate of the crystal's error, which rtc_trim holds (and is saved with) if the GPS is lost. In standby
+ *  the GPS isn't used (EUSART2 can't receive while the PIC sleeps), so the clock runs on that trim until it wakes.
+ *  The offset counts the trim owed to the RTC (trim_acc, and a 256-tick step being made to the second the PPS is measured from), so the
+ *  steps the trim is applied in don't upset the loop. The clock keeps UTC plus GPS_UTC_OFFSET
+ *
+ * >Radio time code. A DCF77 or MSF receiver's output goes to RB2, which is sampled every 1ms tick. RadioSample() ignores changes shorter than
+ *  RADIO_FILTER_MS and passes the start & width of each pulse (carrier reduced) to RadioTask(), which does the rest: it keeps in step with
+ *  the seconds (a pulse starts each), finds the minute mark (DCF77: a second with no pulse, MSF: a 500ms pulse), reads a bit (or MSF's two)
+ *  from each second and, at the next minute mark, checks the frame's length, fixed bits, parity, BCD digits, date & weekday. The frame gives
+ *  the minute which starts at that mark, and the RTC is set to it (with the time since the mark) once two frames in a row agree. Either code
+ *  is decoded, whichever is received. It is the local time transmitted (CET/CEST, GMT/BST), and while a GPS receiver is being used the RTC
+ *  is left to it (the GPS is locked & has set the RTC within RADIO_GPS_SECS). Like the GPS, it isn't used in standby (the tick stops)
+ *
  * >The program has basic error reporting/debugging built in when running on the PIC. Errors are denoted by 'Er' on the display, with the error code displayed in
  *  binary on the LEDs. The error codes are:
- *      -Er (1) - Function Num2Disp has been passed an integer which is outside the range 0<=x<=99 and cannot display it
+ *      -Er (1) - Function Num2Disp has been passed a value which isn't two BCD digits (e.g. a number greater than 99 passed to Bin2Bcd) and cannot display it
  *      -Er (2) - The combination of toggle switches does not correspond to a menu option. Correct this to enter a defined mode
  *      -Er (3) - Function CurrentDisplay has been passed an index which is outside the range expected and doesn't have anything to display for that index
- *      -Er (4) - The combination of toggle swithces does not correspond to a setting option for either Alarm1/Alarm2
+ *      -Er (4) - The combination of toggle swithces does not correspond to a setting option for the alarm being set
  * 
  * Notes:
  * [1] C18 Peripheral Library OpenTimer functions have not been used due to incompatibilities between the XC8/C18 library versions in use on the computer used
@@ -33,16 +137,178 @@
 
 //Various pre-processor directives for global delays used in the program to allow easy editing
 //Delays are given in multiples of 10/100/1000/10,000 TCY, unless otherwise stated
-#define SET_MENU_FLASH 100          //Rate at which dd/mm/yy hh:mm:ss flashes upon entering set time/date mode
-#define ALARM_TOGGLE 150            //Rate at which display toggles between alarm no. (A1/A2) and setting (on/off) in alarm set mode
-#define DEBOUNCE_DELAY 25           //(milliseconds) Delay for debouncing push-buttons
-#define KEY_REPEAT_DELAY 25         //Rate at which value increments/decrements when a button is held repeatedly
+#define SET_MENU_FLASH 400          //(milliseconds) Rate at which the name of the field (or the alarm no.) flashes upon entering a set mode
+#define MENU_FLASHES 4              //No. of SET_MENU_FLASH phases (name, blank, name, blank) before the value being set is shown
+#define ALARM_TOGGLE 600            //(milliseconds) Rate at which display toggles between alarm no. (A1/A2) and setting (on/off) in alarm set mode
+#define DEBOUNCE_DELAY 25           //(milliseconds) Time a push-button input must be stable for before its debounced state changes
+#define KEY_REPEAT_DELAY 100        //(milliseconds) Rate at which value increments/decrements when a button is held repeatedly
+#define MENU_POLL_RATE 20           //(milliseconds) Rate at which the setting menu reads the toggle switches & push buttons
+#define BUTTON_POLL_RATE 100        //(milliseconds) Rate at which the display steps through dd/mm/yy hh:mm:ss when PB1/PB2 are held in normal mode
 #define DISPLAY_CYCLE_DELAY 3000    //(milliseconds) Rate at which display cycles between dd/mm/yy hh:mm:ss when in normal mode
-#define ALARM_POLL_RATE 50          //(milliseconds) How often should the alarms be polled to see if they are equal to the main date/time
-#define ALARM_REPEAT_DELAY 100      //Delay between repetition of alarm tone
-
-#define TIMER0_VALUE 63036          //Value loaded into Timer0 to produce ~1ms delay
-#define TIMER1_VALUE 32768          //Value loaded into Timer1 to produce 1 second delay (for RTC)
+#define GPS_POLL_RATE 10            //(milliseconds) Rate at which NMEA sentences received from the GPS receiver are parsed
+#define RADIO_POLL_RATE 20          //(milliseconds) Rate at which the pulses from the radio time-code receiver are decoded
+#define UART_POLL_RATE 10           //(milliseconds) Rate at which commands received on the UART are handled
+#define UART_TIMEOUT 100            //(milliseconds) Time after which a command frame which has stopped part way through is dropped
+#define SAVE_POLL_RATE 5            //(milliseconds) Rate at which the settings are checked for being due to be saved, and the next byte is written while saving
+#define DIM_POLL_RATE 250           //(milliseconds) Rate at which the time of day & time since the last input are checked to set the brightness of the displays
+#define ALARM_REPEAT_DELAY 400      //(milliseconds) Delay between repetition of alarm tone
+
+//Modes of PowerSave() (the value of OSCCONbits.IDLEN used with the SLEEP instruction)
+#define POWER_SLEEP 0               //Stop the CPU & the primary oscillator. Only Timer1 (from its own oscillator) & INT0 can wake the PIC
+#define POWER_IDLE 1                //Stop the CPU only. Any interrupt wakes the PIC
+
+//Display brightness modes chosen by DimTask() (indexes in DimLevels[] & DimRefresh[])
+#define DIM_DAY 0
+#define DIM_NIGHT 1
+#define DIM_IDLE 2
+
+//Bits of wake_reason/the value returned by PowerSave()
+#define WAKE_RTC 0x01               //Timer1 (1Hz RTC)
+#define WAKE_TICK 0x02              //CCP5 (1ms tick)
+#define WAKE_BUTTON 0x04            //INT0 (PB2 pressed)
+#define WAKE_EEPROM 0x08            //EEIF (data EEPROM write finished)
+#define WAKE_UART 0x10              //RC1IF (byte received on the UART, or the start of one woke the PIC from standby)
+#define WAKE_GPS 0x20               //INT1 (PPS from the GPS receiver)
+
+//Bits of disp_dirty, the reasons the date/time on the displays needs rendering again
+#define DIRTY_TIME 0x01             //Timer1 ISR has counted a second
+#define DIRTY_INDEX 0x02            //disp_index has moved on/back
+#define DIRTY_SCREEN 0x04           //Something else (the boot test, setting menu or a sounding alarm) has written over the displays
+
+//States of the setting menu (menu_state), stepped by MenuTask()
+#define MENU_OFF 0                  //Toggle switches all off, the date/time is shown
+#define MENU_FLASH 1                //Flashing the name of the field (or the alarm no.) on entering a set mode
+#define MENU_EDIT 2                 //PB2/PB1 step the field being set forwards/backwards
+#define MENU_ALARM_ON 3             //PB2/PB1 switch the selected alarm on/off
+#define MENU_SELECT 4               //PB2/PB1 step through the alarms
+#define MENU_ERROR 5                //The toggle switches don't choose a set mode, 'Er' is shown
+
+#define MAX_TASKS 8                 //Size of the task table. Must be at least the number of AddTask() calls in main()
+#define MAX_ALARMS 16               //Size of the alarm table. Each alarm costs RAM only, not code
+
+#define TICK_TCY 2500               //No. of TCY (Timer3 counts) in the 1ms tick. Added on to CCPR5 at each tick
+#define TIMER1_HIGH 0x80            //Added to TMR1H at each Timer1 overflow so that it next overflows 2^15 crystal ticks (1 second) later (for RTC)
+#define RTC_TRIM_PPM 0              //(ppm) Initial value of rtc_trim, measured for the board's crystal. Positive if the clock runs slow, negative if it runs fast
+#ifndef BATTERY_BACKED
+#define BATTERY_BACKED 0            //1 for a unit with a backup battery, which goes into standby when left alone. Build with -DBATTERY_BACKED=1 to set it
+#endif
+#define STANDBY_TIMEOUT (BATTERY_BACKED ? 60 : 0)   //(seconds) Time with no input after which the clock goes into standby. 0 (mains units) never does
+#define DIM_TIMEOUT 20              //(seconds) Time with no input after which the displays are dimmed & refreshed more slowly (DIM_IDLE)
+#define DIM_FROM_HRS 0x22           //(packed BCD) Displays are dimmed for the night (DIM_NIGHT) from DIM_FROM_HRS:00:00 until DIM_TO_HRS:00:00
+#define DIM_TO_HRS 0x07
+#define BRIGHT_LEVELS 8             //No. of brightness levels above off (0). At BRIGHT_LEVELS a display is on for all of its time
+#define TRIM_STEP 15625             //(1/2 ppm) 256 crystal ticks (one count of TMR1H) as a fraction of a second, the smallest correction applied to one second
+#define TONE_TCY_PER_UNIT 20        //No. of TCY per unit of the note values below (note * TONE_TCY_PER_UNIT = half-period of the note)
+
+#define EE_SIZE 1024                //Bytes of data EEPROM
+#define EE_SLOT_SIZE (sizeof(SAVED) + 2)    //Bytes of each EEPROM slot: a saved record & its CRC
+#define EE_SLOTS ((EE_SIZE - EE_SNAP_SIZE) / EE_SLOT_SIZE)   //No. of slots the records are written to in turn, to spread the wear. Must be less than 128
+#define EE_EMPTY 0xFF               //Sequence no. of an erased (or rejected) slot. Never given to a record
+#define SAVE_IDLE 0xFFFF            //Value of save_pos when no save is in progress
+#define SAVE_CHUNK 16               //Max. no. of bytes SaveStep() compares with the EEPROM per call, so the main loop isn't held up
+#define SAVE_DELAY 10               //(seconds) Time after the settings are changed before they are saved, so that changes made together are saved together
+#define EE_SNAP_SIZE (8 + ((MAX_ALARMS + 7) / 8))  //Bytes of the power-fail snapshot: sequence no., epoch_secs, Timer1 phase, alarm on bits & CRC
+#define EE_SNAP_ADDR (EE_SIZE - EE_SNAP_SIZE)    //EEPROM address of the snapshot, after the slots
+#define HLVD_LEVEL 0x0E             //(HLVDL) Supply voltage the HLVD trips at. 0x0E is the highest fixed level (about 4.6V), which leaves the most hold-up for the snapshot
+#define DOWNTIME_MS 100             //(milliseconds) Estimate of the time the clock stops for in a power cut, from the snapshot to running again: the supply's
+                                    //hold-up after it is written & the start-up at power on. The time the power was off for can't be measured with nothing running
+#define LOAD_NONE 0                 //LoadSettings() found nothing to restore
+#define LOAD_SAVED 1                //LoadSettings() restored a saved record
+#define LOAD_SNAPSHOT 2             //LoadSettings() restored a saved record & the power-fail snapshot taken after it
+#define SAVE_PERIOD 900             //(seconds) Rate at which the time is saved, so that it can be restored after a reset. Each byte is written at
+                                    //most once per EE_SLOTS saves, so at 100k write cycles the EEPROM lasts over 15 years
+
+#define UART_BRG 259                //SPBRGH1:SPBRG1 for 9600 baud (9615, +0.16%) with BRGH & BRG16 set: Fosc / (4 * (UART_BRG + 1))
+#define UART_RX_SIZE 32             //Size of the UART receive & transmit ring buffers. Must be powers of 2 (no more than 256)
+#define UART_TX_SIZE 64
+#define UART_SYNC 0xA5              //First byte of every command & reply frame
+#define UART_MAX_DATA 19            //Max. no. of data bytes in a command or reply frame (the reply to CMD_GET_COUNTERS, with its status)
+#define UART_REPLY 0x80             //ORed into the command byte of the reply to it
+
+//UART commands, see UartCommand()
+#define CMD_GET_TIME 0x01
+#define CMD_SET_TIME 0x02
+#define CMD_GET_ALARM 0x03
+#define CMD_SET_ALARM 0x04
+#define CMD_GET_COUNTERS 0x05
+#define CMD_GET_GPS 0x06
+
+//Status of a UART command, the first data byte of the reply
+#define STATUS_OK 0
+#define STATUS_BAD_CMD 1            //Unknown command
+#define STATUS_BAD_LEN 2            //Wrong no. of data bytes for the command
+#define STATUS_BAD_VALUE 3          //A value is out of range (e.g. 25 hours, or an alarm no. past MAX_ALARMS)
+#define STATUS_BUSY 4               //The setting menu is in use, so the time/alarms can't be set
+
+//Indexes in counters[], read with CMD_GET_COUNTERS
+#define COUNT_FRAMES 0              //Commands received with a good CRC
+#define COUNT_ERRORS 1              //Frames dropped for a bad CRC or length, or as they stopped part way through
+#define COUNT_OVERRUNS 2            //Bytes lost as a receive buffer (or the EUSART's) was full, on either EUSART. Counted by the ISRs in uart_overruns
+#define COUNT_DROPPED 3             //Replies dropped as the transmit buffer was full
+#define COUNT_SAVES 4               //Records saved to the EEPROM
+#define COUNT_ALARMS 5              //Alarms sounded
+#define COUNT_GPS 6                 //NMEA sentences paired with a PPS & used to discipline the RTC
+#define COUNT_STEPS 7               //Times the RTC has been stepped to the GPS time (rather than slewed)
+#define COUNT_RADIO 8               //Radio time-code frames decoded, and agreeing with the one before, which the RTC was set to
+#define COUNTERS 9
+
+#define GPS_RX_SIZE 64              //Size of the GPS receive ring buffer. Must be a power of 2 (no more than 256)
+#define GPS_UTC_OFFSET 0            //(seconds) Added on to UTC to give the time kept, e.g. 3600 for UTC+1
+#define GPS_PAIR_MS 900             //(milliseconds) Max. time from a PPS to the end of the sentence naming its second, for them to be paired
+#define GPS_STEP_TICKS 4096         //(crystal ticks) Offset (125ms) beyond which the RTC is stepped rather than slewed
+#define GPS_HALF_TICKS 16384        //(crystal ticks) Half a second. A PPS this far or more into the RTC's second is taken as early for the next
+#define GPS_KP 2                    //(ppm per crystal tick) Proportional gain of the loop which slews the RTC
+#define GPS_FREQ_SCALE 32           //gps_freq is in units of 1/GPS_FREQ_SCALE ppm, and the offset (ticks) is taken off it each second (the integral gain)
+#define GPS_TRIM_MAX 500            //(ppm) Limit on the trim the loop sets, and on its frequency estimate
+#define NMEA_FIELD_MAX 10           //Max. no. of characters kept of each field of an NMEA sentence (the longest used is the time, hhmmss.sss)
+
+#define RADIO_ACTIVE 1              //Level of RB2 while the receiver's carrier is reduced (a pulse). Receiver modules differ
+#define RADIO_FILTER_MS 8           //(milliseconds) Time RB2 must be stable for before a change is taken as an edge, so glitches are ignored
+#define RADIO_PULSES 4              //Size of the ring buffer of pulses for RadioTask(). Must be a power of 2
+#define RADIO_JITTER_MS 60          //(milliseconds) How far from 1s (or 2s) after the last a pulse may start and still start a second
+#define RADIO_LOST_MS 2500          //(milliseconds) Time with no pulse starting a second after which the next minute mark is waited for again
+#define RADIO_NO_SYNC 0xFF          //radio_sec until a minute mark has been seen
+#define RADIO_GPS_SECS 120          //(seconds) The radio is left alone while the GPS has set/slewed the RTC within this long (it is locked)
+
+//Widths of the pulses of the radio time codes, returned by RadioWidth()
+#define RADIO_NOISE 0               //Not a pulse of either code
+#define RADIO_SHORT 1               //100ms: DCF77 0, MSF A=0 (B=1 if a second one follows 200ms after it started)
+#define RADIO_LONG 2                //200ms: DCF77 1, MSF A=1 B=0
+#define RADIO_LONGER 3              //300ms: MSF A=1 B=1
+#define RADIO_MARK 4                //500ms: MSF minute mark
+
+//States of the NMEA parser (nmea_state)
+#define NMEA_IDLE 0                 //Waiting for the '$' which starts a sentence
+#define NMEA_BODY 1                 //Reading the fields, up to the '*'
+#define NMEA_SUM_HIGH 2             //Reading the two hex digits of the checksum
+#define NMEA_SUM_LOW 3
+
+//Sentences the NMEA parser reads (nmea_type). Others are checked but ignored
+#define NMEA_OTHER 0
+#define NMEA_RMC 1                  //$--RMC: time, status (A = valid), ..., date (ddmmyy)
+#define NMEA_ZDA 2                  //$--ZDA: time, day, month, year
+
+//Bits of nmea_have, the fields of the sentence being read which have been found valid
+#define HAVE_TIME 0x01
+#define HAVE_DATE 0x02
+#define HAVE_FIX 0x04
+
+#define EPOCH_YEAR 2000             //epoch_secs counts seconds from 00:00:00 01/01/EPOCH_YEAR. 2000-2099 fits in 32 bits
+#define SECS_PER_DAY 86400UL        //No. of seconds in a day
+#define NO_ALARM 0xFFFFFFFFUL       //Value of alarm_epoch when no alarm is enabled. epoch_secs never reaches it
+
+//Days from 01/01/EPOCH_YEAR to the start of year y (0-99) after it, and days from the start of a year to the start of month m (1-13)
+#define YEAR_START(y) ((365 * (unsigned int)(y)) + (((y) + 3) >> 2))
+#define MONTH_START(m, leap) (DaysBeforeMonth[(m)] + (((leap) != 0) && ((m) > 2)))
+
+//Bits of the flags member of ALARM
+#define ALARM_ON 0x80               //Alarm is enabled
+#define ALARM_DATED 0x40            //Alarm goes off once, at its date & time, rather than at its time of day
+#define ALARM_MELODY 0x0F           //Index in Melodies[] of the melody the alarm plays
+#define MELODY_COUNT 2              //No. of melodies in Melodies[]
+
+//Repeat mask of ALARM. Bit n set = repeat on weekday n (0 = Sunday), 0 = go off once
+#define REPEAT_DAILY 0x7F
 
 //Define bit patterns to display the following on LEDs or to take inputs from the switches
 #define HRS 0x04
@@ -51,12 +317,12 @@
 #define DAY 0x20
 #define MONTH 0x10
 #define YEAR 0x08
-#define ALARM1 0x80
-#define ALARM2 0x40
+#define ALARM_TIME 0x80
+#define ALARM_DATE 0x40
+#define ALARM_SELECT 0xC0
 
 //Define notes from C4 (middle C) to C6
-//These are given as half the no. of 10*TCYs required to generate the frequency of the note,
-//to avoid overflowing the Delay10KTCYx function in the pre-processor macro below
+//These are given as the half-period of the note in units of TONE_TCY_PER_UNIT TCYs, so that they fit in a char
 //Notes with an 'S' in them are sharps
 #define D6  53
 #define	C6	60
@@ -92,30 +358,28 @@
 #define QUAVER  (CROTCHET / 2)
 #define SEMIQUAVER (QUAVER /2)
 
-//Pre-processor macro to generate a note for a particular length of time
-#define GEN_NOTE(length, note, delay) \
-        while(ms_count3 <= length && !PB1pressed() && !PB2pressed()) {  /*Test to see if time for note has elapsed or if PB1/PB2 have been pressed (terminates alarm)*/ \
-            LATJbits.LATJ6 = 1;                                         /*If time hasn't elapsed, play note by generating a square wave of a specific frequency*/ \
-            Delay10TCYx(note);                                          /*on RJ6 (piezo buzzer), by setting it high, delaying, low, delaying*/ \
-            Delay10TCYx(note); \
-            LATJbits.LATJ6 = 0; \
-            Delay10TCYx(note); \
-            Delay10TCYx(note); \
-            }                  \
-        ms_count3 = 0;         \
-        while(ms_count3 <= delay && !PB1pressed() && !PB2pressed());  /*Generate a delay between notes equal to the length of delay passed in*/ \
-        ms_count3 = 0; \
-        if(PB1pressed() || PB2pressed())                               /*Test to see if PB1/PB2 have been pressed, if so, break from playing alarm tone as alarm*/ \    
-            break;                                                     /*has been acknowledged and reset*/
-            
-#define GEN_PAUSE(length) \
-        while(ms_count3 <= length && !PB1pressed() && !PB2pressed()) { \
-            LATJbits.LATJ6 = 0; \
-            } \
-        ms_count3 = 0; \
-        if(PB1pressed() || PB2pressed()) \
-            break;
-            
+//Pre-processor macros to build melody tables. Each step of a melody is 2 bytes: the note (or REST), then the length of the note in
+//semiquavers - 1 (high nibble) and the gap after it in semiquavers (low nibble). Tables end with MELODY_END, after which the melody repeats
+#define REST 0
+#define MELODY_END 0xFF
+#define NOTE(length, note, gap) (note), (((((length) / SEMIQUAVER) - 1) << 4) | ((gap) / SEMIQUAVER))
+#define PAUSE(length) NOTE(length, REST, 0)
+
+//Define a type TASK as a struct with 3 members to store a periodic task in the task table
+typedef struct {
+    void (*run)(void);          //Function called each time the task is due
+    unsigned int period;        //(milliseconds) How often the task is run
+    unsigned int last;          //ms_ticks value when the task was last due
+} TASK;
+
+//Define a type FRAME as a struct to store the port values which show one of the LEDs, U1 or U2
+typedef struct {
+    char latf;                  //Bit pattern to show, written to LATF
+    char lath;                  //LATH & LATA values which enable the display/LEDs this pattern is for
+    char lata;
+    unsigned int on_tcy;        //No. of TCY the display is lit for each time it is shown before CCP3 blanks it, or 0 if it isn't blanked
+} FRAME;
+
 //Define a type TIME as a struct with 3 members to store times            
 typedef struct {
     char hrs;
@@ -131,54 +395,148 @@ typedef struct {
     unsigned int year_long;
 } DATE;
 
+//Define a type CLOCK as a struct with 6 members to store the date/time shown on the displays, in packed BCD
+typedef struct {
+    char day;
+    char month;
+    char year;
+    char hrs;
+    char mins;
+    char secs;
+} CLOCK;
+
+//Define a type ALARM as a struct to store one entry of the alarm table
+typedef struct {
+    TIME time;                  //Time of day the alarm goes off
+    DATE date;                  //Date the alarm goes off, used only if ALARM_DATED is set
+    char flags;                 //ALARM_ON, ALARM_DATED & the melody index (ALARM_MELODY)
+    char repeat;                //Weekdays the alarm repeats on, see REPEAT_DAILY. Not used by dated alarms
+} ALARM;
+
+//Define a type SAVED as a struct to store the record of the settings kept in each EEPROM slot
+typedef struct {
+    unsigned char seq;          //Counted on (mod 256, skipping EE_EMPTY) for each record saved, so that the newest can be found
+    unsigned long epoch;        //epoch_secs when it was saved
+    signed int rtc_trim;
+    ALARM alarms[MAX_ALARMS];
+} SAVED;
+
 //Function protoypes for compiler
 void interrupt hp_secs_count_isr(void);     //High-priority ISR (1Hz clock)
 void interrupt low_priority lp_isr(void);   //Low-priority ISR (1ms clock for system tasks)
 void Timer1_isr(void);                      //ISR for Timer1 interrupt source
-void Timer0_isr(void);                      //ISR for Timer0 interrupt source
+void Tick_isr(void);                        //ISR for CCP5 interrupt source (1ms tick)
+void Tone_isr(void);                        //ISR for CCP4 interrupt source (tone generator)
+void Blank_isr(void);                       //ISR for CCP3 interrupt source (blanks the display being shown to dim it)
+void PowerFail_isr(void);                   //ISR for HLVD interrupt source (supply failing). Writes the power-fail snapshot to the EEPROM
 void enable_interrupts_all(void);           //Enable all interrupts (global)
 void disable_interrupts_all(void);          //Disable all interrupts (global)
 
-void StartTimer0(void);                     //Configures & starts Timer0
 void StartTimer1(void);                     //Configures & starts Timer1
+void StartTimer3(void);                     //Configures & starts Timer3, and sets up CCP4 for the tone generator, CCP5 for the 1ms tick & CCP3 for dimming
+
+void ToneStart(char note, unsigned int length); //Starts playing note on the buzzer for length milliseconds. Returns immediately
+void ToneStop(void);                        //Stops the note currently being played, if any
+char ToneBusy(void);                        //Returns true (1) while a note is playing, false (0) once it has finished
+void ToneLoad(char note, unsigned int length);  //Sets up the tone generator to play note. Called by ToneStart() & MelodyTick() with low-priority interrupts disabled
 
-void Num2Disp(volatile char *time);         //Displays the number (0 <= x <= 99) on the 7-segment displays
+void MelodyStart(const char *melody);       //Starts playing the melody table passed to it in the background, repeating it until stopped
+void MelodyStop(void);                      //Stops the melody currently being played, if any
+void MelodyTick(void);                      //Steps through the melody being played. Called every 1ms from tick ISR
+
+void Num2Disp(char bcd);                    //Displays the packed BCD number (0x00 - 0x99) on the 7-segment displays
+char Bin2Bcd(char n);                       //Returns the number (0 <= n <= 99) passed to it in packed BCD, or 0xFF if it is out of range
+char BcdInc(char *bcd, char last);          //Adds one to the packed BCD number, wrapping around to 0x00 after last. Returns true (1) if it wrapped around
 void CurrentDisplay(char *i);               //Displays the dd/mm/yy hh:mm:ss corresponding to the disp_index, i, on the 7-segment displays
-void SetMenu(void);                         //Settings menu to provide set date/time/alarm functionality
+void StepDisplay(signed char step);         //Moves disp_index forwards (1) or backwards (-1) through dd/mm/yy hh:mm:ss, wrapping around at either end
 
 char Switches(void);                        //Returns the value of the 8-bit toggle switches on the School IOB
-char PB1pressed(void);                      //Returns true (1) if PB1 has been pressed, false (0) if not. Implements de-bouncing
-char PB2pressed(void);                      //Returns true (1) if PB2 has been pressed, false (0) if not. Implements de-bouncing
+char PB1pressed(void);                      //Returns true (1) if PB1 is held down (debounced), false (0) if not
+char PB2pressed(void);                      //Returns true (1) if PB2 is held down (debounced), false (0) if not
+char PB1clicked(void);                      //Returns true (1) once for each press of PB1 since it was last called, false (0) if not
+char PB2clicked(void);                      //Returns true (1) once for each press of PB2 since it was last called, false (0) if not
+void DebounceButtons(void);                 //Samples PB1/PB2 and updates their debounced state. Called every 1ms from tick ISR
+
+char AddTask(void (*run)(void), unsigned int period);   //Adds a task to the task table to be run every period milliseconds. Returns the task's index
+void RestartTask(char task);                //Restarts the period of the task at the index passed to it from now
+void RunTasks(void);                        //Runs every task in the task table which is due. Called from the main loop
+unsigned int GetTicks(void);                //Returns ms_ticks, read consistently while tick ISR may be updating it
+
+void DisplayCycleTask(void);                //Task to cycle through dd/mm/yy hh:mm:ss on the displays every DISPLAY_CYCLE_DELAY ms
+void DimTask(void);                         //Task to choose the brightness & refresh rate of the displays from the time of day & time since the last input
+void SetDisplayLevels(const char *levels, char div);    //Sets the brightness of the LEDs, U1 & U2 (levels[0-2], 0 - BRIGHT_LEVELS) and shows each for div ms in turn
+void ButtonTask(void);                      //Task to step the display while PB1/PB2 are held, or to acknowledge a sounding alarm
+void AcknowledgeAlarm(void);                //Stops the sounding alarm
+void ScheduleAlarms(unsigned long from);    //Works out when each alarm is next due at or after epoch time from, and sorts them into alarm_order
+void SoundNextAlarm(void);                  //Sounds the alarm at the head of alarm_order, then works out when it is next due and moves it down the list
+void LoadNextAlarm(void);                   //Passes the time of the alarm at the head of alarm_order to Timer1 ISR
+unsigned long AlarmNextFire(char n, unsigned long from);    //Returns the epoch time alarm n is next due at or after from, or NO_ALARM if it isn't
+unsigned long GetEpoch(void);               //Returns epoch_secs, read consistently while Timer1 ISR may be updating it
+void SetEpoch(unsigned long e, unsigned int ticks);    //Sets epoch_secs, with ticks (< 2^15) crystal ticks of the second already counted in Timer1, so that GetEpoch() never sees either part-written
+void ShiftEpoch(unsigned long by);          //Adds by on to epoch_secs (mod 2^32, so it can also move it back), keeping the time into the current second
+
+char LoadSettings(void);                    //Restores the time, alarms & rtc_trim from the newest valid record in the EEPROM, and the power-fail snapshot if it was taken since. Returns a LOAD_ value
+void StartHLVD(void);                       //Configures the HLVD to interrupt when the supply is failing
+void SaveLater(void);                       //Marks the settings as changed, so that they are saved SAVE_DELAY seconds from now
+void SaveStep(void);                        //Task to save the settings to the next EEPROM slot when they are due, a byte at a time
+char SaveBusy(void);                        //Returns true (1) while a save is in progress, false (0) if not
+unsigned int Crc16(unsigned int crc, char b);   //Returns the CRC-16-CCITT crc carried on over byte b
+unsigned char EERead(unsigned int addr);    //Returns the byte at addr in the data EEPROM
+void EEWrite(unsigned int addr, char b);    //Starts writing b to addr in the data EEPROM. Returns straight away, EECON1bits.WR is set until it has finished
+
+void StartUart(void);                       //Configures EUSART1 for 9600 baud, 8N1, with its receive interrupt on
+void Uart_rx_isr(void);                     //ISR for RC1IF. Puts the byte received in rx_buf[]
+void Uart_tx_isr(void);                     //ISR for TX1IF. Sends the next byte in tx_buf[], or turns itself off once it is empty
+void UartTask(void);                        //Task to assemble the frames received into commands, and carry them out
+void UartCommand(void);                     //Carries out the command in uart_frame[] & queues the reply to it
+char UartSend(unsigned char *buf, char n);  //Queues n bytes to send. Returns true (1) if they were queued, false (0) if there wasn't room for all of them (none are queued)
+void PutLong(unsigned char *p, unsigned long v);    //Writes v to p[0-3], least significant byte first
+unsigned long GetLong(unsigned char *p);    //Returns the unsigned long at p[0-3], least significant byte first
+
+void StartGps(void);                        //Configures EUSART2 to receive NMEA at 9600 baud, and INT1 for the PPS
+void Pps_isr(void);                         //ISR for INT1 (PPS). Notes where Timer1 is in the second
+void Gps_rx_isr(void);                      //ISR for RC2IF. Puts the byte received in gps_buf[]
+void GpsTask(void);                         //Task to parse the NMEA sentences received, and to finish off a step made by GpsSync()
+void NmeaChar(char c);                      //Steps the NMEA parser on by one character
+void NmeaField(void);                       //Takes what is needed from the field just read (nmea_field of the sentence)
+char NmeaDigits(char n, char at);           //Returns the n-digit decimal no. at nmea_buf[at], or 0xFF if they aren't all digits
+void GpsSync(unsigned long e);              //Disciplines the RTC to the GPS, given e (epoch time) of the second started by the last PPS
+void GpsStep(unsigned long e, unsigned long clock, unsigned int ticks, unsigned int left);  //Sets the RTC so the PPS noted as clock/ticks/left started second e
+
+void RadioSample(void);                     //Samples & filters the radio time-code receiver's output, and passes each pulse to RadioTask(). Called every 1ms from tick ISR
+void RadioTask(void);                       //Task to decode the pulses from the radio time-code receiver
+void RadioPulse(unsigned int start, unsigned int width);    //Steps the decoder on by the pulse which started at start (ms_ticks) & was width ms long
+char RadioWidth(unsigned int width);        //Returns the RADIO_ class of a pulse width ms long
+void RadioFrame(unsigned int mark);         //Checks & decodes the frame just received, and sets the RTC to it if it agrees with the last. mark is when (ms_ticks) its minute started
+char RadioBit(unsigned char *bits, char n);     //Returns bit n of the frame bits passed to it
+char RadioParity(unsigned char *bits, char first, char last);   //Returns the XOR of bits first to last of the frame bits passed to it
+char RadioBcd(char first, char n, signed char step);    //Returns the n-bit BCD no. in radio_a[] from first, stepping by step (1 least significant bit first, -1 most), or 0xFF if it isn't BCD
+
+char PowerSave(char mode);                  //Idles/sleeps the PIC (POWER_IDLE/POWER_SLEEP) until an interrupt wakes it. Returns the reasons it has woken since it was last called (WAKE_ flags)
+void Standby(void);                         //Blanks the displays & sleeps between Timer1 interrupts until PB1/PB2, a toggle switch or a due alarm needs the clock
 
 void ConfigureIO(void);                     //Configure the PIC IO pins for IO on the School IOB using TRIS registers
 void BootTest(void);                        //Boot test routine to check all 7-segment displays, LEDs and buzzer are working
 
-void CalcTime(void);                        //Calculate the time if multiple minutes have rolled over
-void CalcDate(void);                        //Calculate the date (including leap years) if a day has rolled over
-char CalcLeapYear(unsigned int year);       //Calculate whether a particular year is a leap year or not. Returns true (1) if it is, false (0) if not
-
-void SetSecs(volatile TIME *ts);            //Set the seconds member of the time struct passed to it
-void SetMins(volatile TIME *tm);            //Set the minutes member of the time struct passed to it
-void SetHrs(volatile TIME *th);             //Set the hours member of the time struct passed to it
-void SetDay(volatile DATE *dd);             //Set the day member of the date struct passed to it
-void SetMonth(volatile DATE *dm);           //Set the month member of the date struct passed to it
-void SetYear(volatile DATE *dy);            //Set the year member of the date struct passed to it
-
-void SecsFlash(void);                       //Flash 7-segment displays with 'SS' when entering seconds set mode
-void MinsFlash(void);                       //Flash 7-segment displays with 'mi' when entering minutes set mode
-void HrsFlash(void);                        //Flash 7-segment displays with 'hh' when entering hours set mode
-void DayFlash(void);                        //Flash 7-segment displays with 'dd' when entering day set mode
-void MonthFlash(void);                      //Flash 7-segment displays with 'mo' when entering month set mode
-void YearFlash(void);                       //Flash 7-segment displays with 'yy' when entering year set mode
-
-void Alarm1Flash(void);                     //Flash 7-segment displays with 'A1' when entering Alarm1 set mode
-void SetAlarm1(void);                       //Enables/disables Alarm1 and sets the hh:mm:ss that Alarm1 will occur at
-void SoundAlarm1(void);                     //Sounds Alarm1 melody and acknowledges it with a press of PB1/PB2
-void Alarm2Flash(void);                     //Flash 7-segment displays with 'A2' when entering Alarm2 set mode
-void SetAlarm2(void);                       //Enables/disables Alarm2 and sets the dd/mm/yy hh:mm:ss that Alarm2 will occur at
-void SoundAlarm2(void);                     //Sounds Alarm2 melody and acknowledges it with a press of PB1/PB2
-
-char CompareTimes(volatile TIME mainTime, volatile DATE *mainDate, volatile TIME *alarmTime, volatile DATE *alarmDate, char args); //Compares the date and/or time members of the structs passed to it, returns true (1) if equal, false (0) if not. Used for Alarm1/2
+char CalcLeapYear(unsigned int year);       //Calculate whether a particular year (2000-2099) is a leap year or not. Returns true (1) if it is, false (0) if not
+unsigned int DaysFromCivil(volatile DATE *d);   //Returns the no. of days from 01/01/EPOCH_YEAR to the date passed to it
+void CivilFromDays(unsigned int days, volatile DATE *d);    //Works out the date which is days after 01/01/EPOCH_YEAR
+char Weekday(unsigned int days);            //Returns the day of the week (0 = Sunday) of the date which is days after 01/01/EPOCH_YEAR
+unsigned int EpochDays(unsigned long e);    //Returns the no. of whole days in e seconds
+unsigned long DateToEpoch(volatile DATE *d, volatile TIME *t);  //Returns the no. of seconds from 00:00:00 01/01/EPOCH_YEAR to the date/time passed to it
+void EpochToDate(unsigned long e, volatile DATE *d, volatile TIME *t);  //Works out the date/time which is e seconds after 00:00:00 01/01/EPOCH_YEAR
+void UpdateMainTime(void);                  //Works out MainClock from epoch_secs, if it has changed since they were last worked out
+
+void MenuTask(void);                        //Task to step the setting menu: enters/leaves set modes as the toggle switches change & handles PB1/PB2 in them
+void MenuEnter(char sw);                    //Enters the set mode chosen by the toggle switches, sw, or leaves the menu if sw is 0
+void MenuLeave(void);                       //Leaves the current set mode, carrying any change made to the shadow of the RTC over to it
+void MenuShow(void);                        //Shows the value being set (or the selected alarm & its setting) on the 7-segment displays
+char WrapStep(char value, char first, char last, signed char step);    //Returns value stepped forwards (1) or backwards (-1), wrapping around between first & last
+void StepField(char field, TIME *t, DATE *d, signed char step);  //Steps the field (SECS - DAY) of the date/time passed to it forwards (1) or backwards (-1)
+char FieldValue(char field, TIME *t, DATE *d);  //Returns the field (SECS - DAY) of the date/time passed to it
+void FieldName(char field);                 //Shows the name of the field ('SS', 'mi', 'hh', 'dd', 'mo', 'yy') on the 7-segment displays
+void AlarmNumDisp(char n);                  //Displays the no. of alarm n on the 7-segment displays ('A1'-'A9', then 10 upwards)
+void SoundAlarm(char n);                    //Starts sounding alarm n's melody. It is acknowledged with a press of PB1/PB2, see ButtonTask()
 
 
 //CONSTANT GLOBAL VARIABLES
@@ -220,189 +578,634 @@ const char DaysInMonth[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 //Array of chars containing number of days in each month for leap years
 const char DaysInMonthLeap[] = {0, 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 
+//Array of ints containing number of days in a non-leap year before the start of each month. The last element is the start of the next year
+const unsigned int DaysBeforeMonth[] = {0, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365};
+
+//Alarm melodies, see NOTE() for the format
+//Melody1 - Jingle Bells
+const char Melody1[] = {
+    NOTE(CROTCHET, C5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, F5, QUAVER),
+    //--
+    NOTE(MINIM, C5, CROTCHET),
+    NOTE(QUAVER, C5, SEMIQUAVER),
+    NOTE(QUAVER, C5, QUAVER),
+    //--
+    NOTE(CROTCHET, C5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, F5, QUAVER),
+    //--
+    NOTE(MINIM, D5, QUAVER),
+    PAUSE(MINIM),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    //--
+    NOTE(MINIM, E5, QUAVER),
+    PAUSE(MINIM),
+    //--
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    //--
+    NOTE(MINIM, A5, QUAVER),
+    PAUSE(MINIM),
+    //--
+    NOTE(CROTCHET, C5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, F5, QUAVER),
+    //--
+    NOTE(MINIM, C5, QUAVER),
+    PAUSE(MINIM),
+    //-
+    NOTE(CROTCHET, C5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, F5, QUAVER),
+    //--
+    NOTE(MINIM, D5, QUAVER),
+    PAUSE(MINIM),
+    NOTE(CROTCHET, D5, QUAVER),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    //--
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(QUAVER, C6, SEMIQUAVER),
+    NOTE(QUAVER, C6, QUAVER),
+    //--
+    NOTE(CROTCHET, D6, QUAVER),
+    NOTE(CROTCHET, C6, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    //--
+    NOTE(MINIM, F5, CROTCHET),
+    NOTE(MINIM, C6, QUAVER),
+    //--Chorus
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(MINIM, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(MINIM, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, C6, SEMIQUAVER),
+    NOTE(CROTCHET, F5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    //--
+    NOTE(SEMIBREVE, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    NOTE(CROTCHET, AS5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(QUAVER, A5, SEMIQUAVER),
+    NOTE(QUAVER, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    //--
+    NOTE(MINIM, G5, QUAVER),
+    NOTE(MINIM, C6, QUAVER),
+    MELODY_END
+};
+
+//Melody2 - Ode to Joy
+const char Melody2[] = {
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    //--
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(MINIM, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    //--
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(MINIM, D5, CROTCHET),
+    //--
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    //--
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(QUAVER, FS5, SEMIQUAVER),
+    NOTE(QUAVER, G5, SEMIQUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    //--
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(QUAVER, FS5, SEMIQUAVER),
+    NOTE(QUAVER, G5, SEMIQUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(MINIM, A5, CROTCHET),
+    //--
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, A5, QUAVER),
+    //--
+    NOTE(CROTCHET, A5, QUAVER),
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, FS5, QUAVER),
+    //--
+    NOTE(CROTCHET, E5, QUAVER),
+    NOTE(CROTCHET, D5, QUAVER),
+    NOTE(MINIM, D5, QUAVER),
+    MELODY_END
+};
+
+/*
+//Wake Me Up Before You Go Go (Chorus)
+const char MelodyWakeMeUp[] = {
+    NOTE(QUAVER, G5, QUAVER),
+    NOTE(CROTCHET, B5, SEMIQUAVER),
+    NOTE(CROTCHET, C6, QUAVER),
+    PAUSE(MINIM),
+    //--
+    NOTE(QUAVER, G5, SEMIQUAVER),
+    NOTE(CROTCHET, B5, QUAVER),
+    NOTE(QUAVER, C6, SEMIQUAVER),
+    NOTE(CROTCHET, G5, SEMIQUAVER),
+    NOTE(QUAVER, E5, SEMIQUAVER),
+    //--
+    PAUSE(CROTCHET),
+    NOTE(QUAVER, E5, SEMIQUAVER),
+    NOTE(QUAVER, F5, SEMIQUAVER),
+    NOTE(QUAVER, G5, SEMIQUAVER),
+    PAUSE(QUAVER),
+    //--
+    NOTE(QUAVER, A5, QUAVER),
+    NOTE(QUAVER, A5, SEMIQUAVER),
+    NOTE(QUAVER, G5, SEMIQUAVER),
+    NOTE(QUAVER, F5, SEMIQUAVER),
+    NOTE(QUAVER, E5, QUAVER),
+    //--
+    NOTE(CROTCHET, G5, QUAVER),
+    NOTE(QUAVER, B5, SEMIQUAVER),
+    NOTE(CROTCHET, A5, SEMIQUAVER),
+    NOTE(QUAVER, F5, QUAVER),
+    MELODY_END
+};
+*/
+
+//Melodies the alarms can play, indexed by the ALARM_MELODY bits of the alarm's flags
+const char *const Melodies[MELODY_COUNT] = { Melody1, Melody2 };
+
+//Brightness (0 - BRIGHT_LEVELS) of the LEDs, U1 & U2, and no. of ms each is shown for in turn, in each of the DIM_ modes
+const char DimLevels[3][3] = { {8, 8, 8}, {2, 3, 3}, {2, 2, 2} };
+const char DimRefresh[3] = { 1, 1, 2 };
+
 //GLOBAL VARIABLES
 char disp_index = 0;         //Display cycle disp_index, used to track what is being shown (dd/mm/yy hh:mm:ss) on 7-segment displays currently. Used in conjunction with CurentDisplay() function
-char Alarm1On = 0;      //Flag to enable/disable Alarm1
-char Alarm2On = 0;      //Flag to enable/disable Alarm2
+char alarm_sounding = 0;    //Index + 1 of the alarm which is currently sounding, or 0 if none
+char alarm_sel = 0;         //Index of the alarm being set in the setting menu
+char menu_state = MENU_OFF; //MENU_ state of the setting menu
+char menu_sw = 0x00;        //Switches() when the current set mode was entered
+char menu_field;            //Field being set (SECS - DAY), or 0 when switching an alarm on/off
+char menu_phase;            //No. of flash/toggle phases shown so far in the current set mode
+char menu_edited;           //Flag, set once the field has been stepped in the current set mode
+unsigned int menu_last;     //GetTicks() when the display was last flashed/toggled or the field was last stepped
+TIME *menu_t;               //Time & date being set: the shadow of the RTC (menu_time/menu_date) or the selected alarm's. menu_t is 0 in other modes
+DATE *menu_d;
+ALARM *menu_a;              //Alarm being set
+TIME menu_time;             //Shadow of the RTC being set, counted on with it by MenuTask() so that no time is lost while it is being set
+DATE menu_date;
+unsigned long menu_epoch;   //Value of epoch_secs which menu_time/menu_date were last counted on to
+ALARM alarms[MAX_ALARMS];   //Alarm table
+unsigned long alarm_fire[MAX_ALARMS];   //Epoch time each alarm is next due, or NO_ALARM if it isn't. Set by ScheduleAlarms()/SoundNextAlarm()
+char alarm_order[MAX_ALARMS];           //Indexes of the alarms, sorted so that the one due soonest is first
+TASK tasks[MAX_TASKS];      //Task table, see AddTask()
+char n_tasks = 0;           //No. of tasks in the task table
+char display_task;          //Index of DisplayCycleTask in the task table, so that it can be restarted when the display is stepped by hand
 
 //Volatile variables modified in ISRs
-volatile char multiplex_index = 1;          //Used to track which display is currently illuminated for multiplexing purposes
-volatile unsigned int ms_count0 = 0;        //millisecond counter variables, incremented by Timer0 ISR, reset by functions which use them
-volatile unsigned int ms_count1 = 0;
-volatile unsigned int ms_count2 = 0;
-volatile unsigned int ms_count3 = 0;
-volatile char disp_U1, disp_U2, disp_LEDS;  //char variables to hold bit patterns of current output on 7-segment displays/LEDs. These are modified by functions when they change what is displayed
-volatile char dp_mask = 0xFF;               //Mask used for decimal point of 7-segment display U1, so that second indicator keeps flashing when in set modes
-volatile char day_rollover = 0;             //Flag, set when a day rollover (23:00->00:00HRS) has occurred
-volatile char mins_rollover = 0;            //Flag, set when a minute rollover has occurred 
-
-volatile TIME MainTime, Alarm1Time, Alarm2Time;     //Declare structs of type TIME to store the RTC, Alarm1 & Alarm2 times
-volatile DATE MainDate, Alarm1Date, Alarm2Date;     //Declare structs of type DATE to store the RTC, Alarm1 & Alarm2 dates
+volatile char multiplex_index = 0;          //Used to track which display is currently illuminated for multiplexing purposes (index in frame[])
+volatile unsigned int ms_ticks = 0;         //Millisecond tick count, incremented by tick ISR. Wraps around, so only differences between two values are meaningful
+volatile FRAME frame[3] = { {0x00, 0x03, 0x10, 0}, {0x00, 0x02, 0x00, 0}, {0x00, 0x01, 0x00, 0} };    //Port values for the LEDs (LH0, LH1 & LA4 set), U1 (LH1 set) & U2 (LH0 set), output in turn by tick ISR
+volatile char refresh_div = 1;              //No. of ticks each display is shown for in turn. Written by SetDisplayLevels()
+volatile char refresh_count = 0;            //Ticks the current display has been shown for
+char dim_mode = DIM_DAY;                    //DIM_ mode the displays are in, chosen by DimTask()
+volatile char dp_mask = 0xFF;               //Mask used for decimal point of 7-segment display U1, so that second indicator keeps flashing when in set modes. Applied whenever disp_U1 is written
+
+//Bit patterns of current output on 7-segment displays/LEDs. These are modified by functions when they change what is displayed, and are
+//written straight into the frame buffer
+#define disp_LEDS frame[0].latf
+#define disp_U1 frame[1].latf
+#define disp_U2 frame[2].latf
+volatile unsigned long epoch_secs = 0;      //Seconds since 00:00:00 01/01/EPOCH_YEAR, incremented by Timer1 ISR. This is the RTC, MainClock is worked out from it
+volatile unsigned char rtc_seq = 0;         //Counted on by Timer1 ISR, SetEpoch() & ShiftEpoch() each time they have changed epoch_secs. Used by GetEpoch() to check its copy is whole
+volatile unsigned long alarm_epoch = NO_ALARM;  //Value of epoch_secs at which the alarm at the head of alarm_order is due. Written by LoadNextAlarm() with Timer1 interrupt disabled
+volatile char alarm_due = 0;                //Flag, set by Timer1 ISR when the alarm at the head of alarm_order is due. Cleared when the main loop sounds it
+volatile signed int rtc_trim = RTC_TRIM_PPM;    //(ppm) Correction for the error of the 32.768kHz crystal, applied by Timer1 ISR. Must be within +/-7812
+signed int trim_acc = 0;                    //(1/2 ppm) Trim accumulated towards the next TRIM_STEP correction. Written only by Timer1 ISR, and GpsStep()
+volatile char wake_reason = 0;              //WAKE_ flags, set by the ISRs. Read & cleared by PowerSave()
+volatile char disp_dirty = DIRTY_SCREEN;    //DIRTY_ flags, set by Timer1 ISR & the main loop. Cleared by the main loop when it renders the date/time
+volatile unsigned char idle_secs = 0;       //Seconds since there was last any input, counted (up to 255) by Timer1 ISR. Cleared by the main loop
+volatile char pb1_down = 0, pb2_down = 0;   //Debounced state of PB1/PB2, 1 while the button is held down. Written only by DebounceButtons()
+volatile char pb1_edge = 0, pb2_edge = 0;   //Set by DebounceButtons() when PB1/PB2 is pressed, cleared when read by PB1clicked()/PB2clicked()
+char pb1_count = 0, pb2_count = 0;          //Number of consecutive ticks PB1/PB2 input has differed from its debounced state. Used only by DebounceButtons()
+volatile unsigned int tone_half_period;     //Half-period (TCY) of the note being played. Added on to CCPR4 by Tone_isr() each time the buzzer is toggled
+volatile unsigned int tone_ms = 0;          //Milliseconds of the current note remaining, counted down by tick ISR
+volatile char tone_on = 0;                  //Flag, set while a note is playing. Cleared by tick ISR when the note has finished
+const char *melody = 0;                     //Melody table being played, or 0 if none. Used by MelodyTick() in tick ISR
+unsigned char melody_pos;                   //Index of the next step in the melody table
+unsigned int melody_ms;                     //Milliseconds until the next step of the melody is due
+
+CLOCK MainClock;            //dd/mm/yy hh:mm:ss of the RTC in packed BCD, worked out from epoch_secs by UpdateMainTime() when it is displayed
+unsigned long main_epoch = NO_ALARM;    //Value of epoch_secs which MainClock was last worked out from
+
+SAVED save_buf;                         //Record being saved by SaveStep(), or read by LoadSettings()
+unsigned char save_seq = EE_EMPTY;      //Sequence no. of the newest record in the EEPROM, or EE_EMPTY if there isn't one
+unsigned char save_slot = EE_SLOTS - 1; //Slot the newest record is in (so that the first is saved to slot 0), or the slot being written while saving
+unsigned int save_pos = SAVE_IDLE;      //Byte of the slot SaveStep() writes next, or SAVE_IDLE if no save is in progress
+unsigned int save_crc;                  //CRC of the bytes of the record passed so far
+unsigned long save_at = NO_ALARM;       //Value of epoch_secs at which the next save is due. Brought forward by SaveLater()
+
+volatile unsigned char rx_buf[UART_RX_SIZE];    //Bytes received, written at rx_head by the UART ISR & read from rx_tail by UartTask()
+volatile unsigned char rx_head = 0;
+unsigned char rx_tail = 0;
+volatile unsigned char tx_buf[UART_TX_SIZE];    //Bytes to send, written at tx_head by UartSend() & read from tx_tail by the UART ISR
+unsigned char tx_head = 0;
+volatile unsigned char tx_tail = 0;
+unsigned char uart_frame[UART_MAX_DATA + 5];    //Command frame being received: sync, command, length, data & CRC (low byte first)
+unsigned char uart_pos = 0;             //No. of bytes of the frame received so far
+unsigned int uart_last;                 //GetTicks() when the last byte of the frame was received
+unsigned char uart_reply[UART_MAX_DATA + 5];    //Reply frame being built, laid out as uart_frame[]
+unsigned int counters[COUNTERS];        //Counts of events, read with CMD_GET_COUNTERS. See COUNT_
+volatile unsigned int uart_overruns = 0;    //Bytes lost on receiving, counted by the UART ISRs (COUNT_OVERRUNS)
+
+volatile unsigned char tmr1_start = TIMER1_HIGH;    //TMR1H at the start of the current second (TIMER1_HIGH, +/-1 when the trim is applied)
+volatile unsigned char gps_buf[GPS_RX_SIZE];    //Bytes received from the GPS receiver, written at gps_head by Gps_rx_isr() & read from gps_tail by GpsTask()
+volatile unsigned char gps_head = 0;
+unsigned char gps_tail = 0;
+volatile unsigned char pps_count = 0;   //Counted on by Pps_isr() after it has written the pps_ values, so a copy can be checked as whole
+volatile unsigned long pps_epoch;       //epoch_secs at the last PPS, with 1 added if Timer1 had overflowed but not yet been counted
+volatile unsigned int pps_ticks;        //Crystal ticks Timer1 had counted into the second at the last PPS, and had left to count until it overflows
+volatile unsigned int pps_left;
+volatile signed int pps_acc;            //(1/2 ppm) Trim still owed to the RTC after the edge of the second the last PPS is measured from
+volatile unsigned int pps_ms;           //ms_ticks at the last PPS
+char gps_locked = 0;                    //Set once the RTC has been stepped to the GPS, after which it is slewed
+unsigned long gps_last;                 //Epoch time of the last second the GPS set/slewed the RTC to. Only meaningful once gps_locked is set
+char gps_stepped = 0;                   //Set by GpsSync() when it has stepped the RTC, for GpsTask() to reschedule the alarms
+unsigned char gps_used;                 //pps_count of the last PPS used, so that an RMC & a ZDA for the same second are only used once
+signed long gps_freq = 0;               //(1/GPS_FREQ_SCALE ppm) Estimate of the trim the crystal needs, the loop's integral
+signed int gps_offset = 0;              //(crystal ticks) Offset of the RTC from the GPS at the last PPS used, positive if it is ahead
+char nmea_state = NMEA_IDLE;            //NMEA parser (NmeaChar())
+char nmea_type;                         //NMEA_ type of the sentence being read
+char nmea_field;                        //No. of the field being read (0 is the address, e.g. GPRMC)
+char nmea_len;                          //Characters of it read so far
+char nmea_buf[NMEA_FIELD_MAX];          //The field being read (only the first NMEA_FIELD_MAX characters)
+unsigned char nmea_sum;                 //XOR of the characters between the '$' & the '*', and the checksum received after it
+unsigned char nmea_check;
+char nmea_have;                         //HAVE_ flags of the sentence being read
+char gps_fix = 0;                       //Set while the last RMC sentence said its fix was valid. A ZDA is only trusted while it is
+TIME nmea_time;                         //Date & time read from the sentence
+DATE nmea_date;
+char radio_level = 0;                   //Filtered state of RB2, 1 during a pulse. Used only by RadioSample()
+char radio_count = 0;                   //Consecutive ticks RB2 has differed from radio_level. Used only by RadioSample()
+unsigned int radio_rise;                //ms_ticks at the start of the pulse in progress. Used only by RadioSample()
+volatile unsigned int radio_starts[RADIO_PULSES];   //Start (ms_ticks) & width (ms) of each pulse, written at radio_head by RadioSample() & read from radio_tail by RadioTask()
+volatile unsigned int radio_widths[RADIO_PULSES];
+volatile unsigned char radio_head = 0;
+unsigned char radio_tail = 0;
+unsigned char radio_sec = RADIO_NO_SYNC;    //Second of the minute the last pulse which started a second is in, or RADIO_NO_SYNC
+unsigned int radio_second;              //ms_ticks at the start of that pulse
+char radio_msf;                         //Set if the frame being received is MSF (it started with a 500ms pulse), clear if it is DCF77
+char radio_bad;                         //Set if a second of the frame being received couldn't be read
+unsigned char radio_a[8];               //Bits of the frame being received, one per second (bit n % 8 of [n / 8]). radio_b[] is MSF's second bit (B)
+unsigned char radio_b[8];
+unsigned long radio_last = 0;           //Epoch time of the minute given by the last good frame, or 0. The next must be 60s on from it to be used
 
 //Main function
 void main(void) {
+    char i, loaded;
+    TIME start_time = {0, 0, 0};            //The clock starts at 00:00:00 01/01/2016
+    DATE start_date = {1, 1, 16, 2016};
    
-    //Initialise all time/date structs
-    MainTime.hrs = 0;
-    MainTime.mins = 0;
-    MainTime.secs = 0;
-    
-    MainDate.day = 1;
-    MainDate.month = 1;
-    MainDate.year_short = 16;
-    MainDate.year_long = 2016;
-
-    Alarm1Time.hrs = 0;
-    Alarm1Time.mins = 0;
-    Alarm1Time.secs = 0;
-    
-    Alarm1Date.day = 0;
-    Alarm1Date.month = 0;
-    Alarm1Date.year_long = 0;
-    Alarm1Date.year_short = 0;
-
-    Alarm2Time.hrs = 0;
-    Alarm2Time.mins = 0;
-    Alarm2Time.secs = 0;
-
-    Alarm2Date.day = 1;
-    Alarm2Date.month = 1;
-    Alarm2Date.year_long = 2016;
-    Alarm2Date.year_short = 16;
+
+    for (i = 0; i < MAX_ALARMS; i++) {         //All alarms start off, at 00:00:00 01/01/2016, playing each melody in turn
+        alarms[i].time.hrs = 0;
+        alarms[i].time.mins = 0;
+        alarms[i].time.secs = 0;
+        alarms[i].date.day = 1;
+        alarms[i].date.month = 1;
+        alarms[i].date.year_long = 2016;
+        alarms[i].date.year_short = 16;
+        alarms[i].flags = i % MELODY_COUNT;
+        alarms[i].repeat = 0;
+    }
+
+    loaded = LoadSettings();    //Carry on from the time & alarms saved in the EEPROM, if there are any
+    if (loaded == LOAD_NONE) {
+        SetEpoch(DateToEpoch(&start_date, &start_time), 0);
+    }
+    save_at = GetEpoch() + ((loaded == LOAD_SNAPSHOT) ? SAVE_DELAY : SAVE_PERIOD);  //Save a restored snapshot soon, so it isn't restored again
+    StartHLVD();
     
     ConfigureIO();              //Configure IO of PIC
 
-    StartTimer0();              //Configure & start Timer0 to allow display multiplexing
-    WriteTimer0(TIMER0_VALUE);         //Write initial value to produce ~1ms delay
-        
+    StartTimer3();              //Configure & start Timer3, CCP4 for the tone generator & CCP5 for the 1ms tick (display multiplexing etc.)
+
+    StartUart();                //Configure EUSART1 for the command channel
+
     enable_interrupts_all();    //Enable all interrupts (globally)
+
+    StartTimer1();              //Configure & start Timer1 to start the 1Hz RTC, before the boot test so that a restored time doesn't fall behind by it
     
     BootTest();                 //Run the boot test to check that the 7-segment displays, LEDs & buzzer are working
 
-    StartTimer1();              //Configure & start Timer1 to start the RTC
-    WriteTimer1(TIMER1_VALUE);         //Write initial value to produce a 1Hz clock        
+    StartGps();                 //Configure EUSART2 & INT1 for the GPS receiver, after the boot test so NMEA doesn't overrun gps_buf before GpsTask runs
+
+    display_task = AddTask(DisplayCycleTask, DISPLAY_CYCLE_DELAY);     //Add periodic tasks to the task table
+    AddTask(ButtonTask, BUTTON_POLL_RATE);
+    AddTask(DimTask, DIM_POLL_RATE);
+    AddTask(MenuTask, MENU_POLL_RATE);
+    AddTask(SaveStep, SAVE_POLL_RATE);
+    AddTask(UartTask, UART_POLL_RATE);
+    AddTask(GpsTask, GPS_POLL_RATE);
+    AddTask(RadioTask, RADIO_POLL_RATE);
+    ScheduleAlarms(GetEpoch());         //Alarms restored from the EEPROM are due from now
 
     //Main while loop, this supervises the scrolling display of date/time, calls functions to evaluate date/time, triggers alarms & tests toggle switches for input
     while (1) {                         
         
-        if (mins_rollover >= 1) {       //Calculates time if minutes has rolled over
-            CalcTime();
-        }
-        if (day_rollover == 1) {        //Calculates date if day has rolled over
-            CalcDate();
-        }
+        RunTasks();                     //Run any periodic tasks which are due
 
-        if (ms_count0 >= DISPLAY_CYCLE_DELAY) {     //Cycle through dd/mm/yy hh:mm:ss on 7-segment displays by incrementing disp_index
-            ms_count0 = 0;
-            if (disp_index < 5) {
-                disp_index++;
-            } else {
-                disp_index = 0;
-            }
+        if ((alarm_due == 1) && (alarm_sounding == 0) && (menu_state == MENU_OFF)) {   //Sound the alarm Timer1 ISR has found to be due, once any alarm
+            SoundNextAlarm();           //already sounding is acknowledged & the menu has been left
         }
 
-        if (PB1pressed() == 1) {                 //If PB1 has been pressed and is held, cycle through dd/mm/yy hh:mm:ss on display by incrementing disp_index 
-            Delay10KTCYx(KEY_REPEAT_DELAY);
-            if (PB1pressed() == 1) {
-                ms_count0 = 0;
-                if (disp_index < 5) {
-                    disp_index++;
-                } else {
-                    disp_index = 0;
-                }
-            }
+        if ((alarm_sounding == 0) && (menu_state == MENU_OFF) && (disp_dirty != 0)) {  //Display date/time element corresponding to disp_index on 7-segment
+            disp_dirty = 0;             //display, unless an alarm or the menu is being shown, only if it has changed. Cleared first, so a second counted while
+            CurrentDisplay(&disp_index);    //rendering isn't lost
         }
 
-        if (PB2pressed() == 1) {                //If PB2 has been pressed and is held, cycle through dd/mm/yy hh:mm:ss on display by incrementing disp_index
-            Delay10KTCYx(KEY_REPEAT_DELAY);
-            if (PB2pressed() == 1) {
-                ms_count0 = 0;
-                if (disp_index > 0) {
-                    disp_index--;
-                } else {
-                    disp_index = 5;
-                }
+        if (PB1pressed() || PB2pressed() || (Switches() != 0x00) || (alarm_sounding != 0)) {
+            idle_secs = 0;              //Any input (or an alarm sounding) keeps the clock out of standby,
+            if (dim_mode == DIM_IDLE) { //and brightens the displays straight away if they have been dimmed for lack of it
+                DimTask();
             }
         }
 
-        CurrentDisplay(&disp_index);    //Display date/time element corresponding to disp_index on 7-segment display
-
-        if (Switches() != 0x00) {       //Test if any of the toggle switches have been set, if so, enter the setting menu
-            SetMenu();
-        }
-        
-        if (ms_count2 >= ALARM_POLL_RATE) {     //Check whether Alarm1/Alarm2 dates/times are equal at polling interval set by ALARM_POLL_RATE
-            if((CompareTimes(MainTime, &MainDate, &Alarm1Time, &Alarm1Date, 1) && Alarm1On) == 1) {     //If they are equal and the alarm is enabled,
-                SoundAlarm1();                                                                          //sound the relevant alarm
-                
-            }
-            if((CompareTimes(MainTime, &MainDate, &Alarm2Time, &Alarm2Date, 2) && Alarm2On) == 1) {
-                SoundAlarm2();
-            }
-            ms_count2 = 0;
+        if ((STANDBY_TIMEOUT != 0) && (idle_secs >= STANDBY_TIMEOUT) && (alarm_due == 0) && (SaveBusy() == 0)) {
+            Standby();                  //Nothing has happened for a while, so blank the displays & sleep until something does
+        } else {
+            PowerSave(POWER_IDLE);      //Nothing else to do until the next interrupt
         }
-
     }
 
     
 }
 
 void interrupt hp_secs_count_isr(void) {     
+    if (INTCONbits.INT0IF == 1) {           //PB2 pressed in standby. INT0 is only enabled by Standby(), to wake the PIC
+        INTCONbits.INT0IF = 0;
+        wake_reason |= WAKE_BUTTON;
+    }
     if (PIR1bits.TMR1IF == 1) {             //Check interrupt source to see if it came from Timer1
         PIR1bits.TMR1IF = 0;                //Clear interrupt flag
-        WriteTimer1(TIMER1_VALUE);                 //Re-load timer to generate next 1 second delay
+        wake_reason |= WAKE_RTC;
+        trim_acc += 2 * rtc_trim;           //Accumulate the trim, and shorten/lengthen this second by 256 crystal ticks once it adds up to that
+        if (trim_acc >= TRIM_STEP) {
+            trim_acc -= TRIM_STEP;
+            tmr1_start = TIMER1_HIGH + 1;
+        } else if (trim_acc <= -TRIM_STEP) {
+            trim_acc += TRIM_STEP;
+            tmr1_start = TIMER1_HIGH - 1;
+        } else {
+            tmr1_start = TIMER1_HIGH;
+        }
+        TMR1H += tmr1_start;                //Add on to the timer rather than re-loading it, so the ticks since the overflow aren't lost
         Timer1_isr();                       //Call interrupt routine
     }
+    if ((INTCON3bits.INT1IF == 1) && (INTCON3bits.INT1IE == 1)) {   //Checked after Timer1 too, so a PPS just after the overflow sees the second counted
+        INTCON3bits.INT1IF = 0;
+        wake_reason |= WAKE_GPS;
+        Pps_isr();
+    }
+    if ((PIR2bits.HLVDIF == 1) && (PIE2bits.HLVDIE == 1)) {     //Checked after Timer1, so the snapshot has the second it has just counted
+        PIR2bits.HLVDIF = 0;
+        PowerFail_isr();
+    }
 }
 
 void interrupt low_priority lp_isr(void) {
-    if(INTCONbits.TMR0IF == 1) {
-        INTCONbits.TMR0IF = 0;
-        WriteTimer0(TIMER0_VALUE);
-        Timer0_isr();
+    if(PIR3bits.CCP3IF == 1) {              //Checked before the tick, so a late blank can't blank the next display
+        PIR3bits.CCP3IF = 0;
+        Blank_isr();
+    }
+    if(PIR3bits.CCP4IF == 1) {
+        PIR3bits.CCP4IF = 0;
+        Tone_isr();
+    }
+    if(PIR3bits.CCP5IF == 1) {
+        PIR3bits.CCP5IF = 0;
+        CCPR5 += TICK_TCY;                  //Schedule the next tick relative to this compare, not to when the ISR ran
+        wake_reason |= WAKE_TICK;
+        Tick_isr();
+    }
+    if(PIR1bits.RC1IF == 1) {               //Cleared by reading RCREG1
+        wake_reason |= WAKE_UART;
+        Uart_rx_isr();
+    }
+    if((PIR1bits.TX1IF == 1) && (PIE1bits.TX1IE == 1)) {    //TX1IF is set whenever TXREG1 is empty, so only act on it while there is something to send
+        Uart_tx_isr();
+    }
+    if(PIR3bits.RC2IF == 1) {               //Cleared by reading RCREG2
+        Gps_rx_isr();
+    }
+    if(PIR2bits.EEIF == 1) {                //An EEPROM write has finished, so SaveStep() can start the next
+        PIR2bits.EEIF = 0;
+        wake_reason |= WAKE_EEPROM;
     }
 }
 
 void Timer1_isr(void) {         
-    if (MainTime.secs < 59)     //If second count is under a minute, continue to increment
-        MainTime.secs++;
-    else {                      
-        MainTime.secs = 0;     //Else, reset seconds back to 0
-        mins_rollover++;       //and set minute rollover flag for main function
+    epoch_secs++;               //Count seconds. The date/time is only worked out from this when it is needed
+    if (epoch_secs == alarm_epoch) {    //Only the alarm at the head of alarm_order needs to be checked
+        alarm_due = 1;
+    }
+    if (idle_secs != 0xFF) {    //Count time since the last input, for standby
+        idle_secs++;
     }
+    disp_dirty |= DIRTY_TIME;   //The date/time on the displays needs rendering again
     dp_mask ^= (1 << 2);       //Toggle decimal point to provide 1Hz flash for timing
+    disp_U1 ^= (1 << 2);       //and on the display, as dp_mask has already been applied to it
+    rtc_seq++;                  //Last, so that GetEpoch() sees a change whenever this ISR ran while it was copying epoch_secs
 }
 
-void Timer0_isr(void) {
-    switch(multiplex_index) {               //Switch case to cycle through display on U1, U2 and LEDs
-            case(1) :                       //The current display is kept track of by multiplex_index
-                LATHbits.LH0 = 1;           //In each case, outputs are set/cleared to enable/disable U1/U2/LEDs
-                LATHbits.LH1 = 1;           //in turn, then the value to be displayed is put onto LATF
-                LATAbits.LA4 = 1;
-                LATF = disp_LEDS;
-                break;
-            case(2) :
-                LATHbits.LH0 = 0;
-                LATHbits.LH1 = 1;
-                LATAbits.LA4 = 0;
-                LATF = disp_U1 & dp_mask;
-                break;
-            case(3) :
-                LATHbits.LH0 = 1;
-                LATHbits.LH1 = 0;
-                LATAbits.LA4 = 0;
-                LATF = disp_U2;
-                multiplex_index = 0;
-                break;
-            default :
-                multiplex_index = 0;        //Reset multiplex_index back to 0 to prevent undefined behaviour
-                break;
+void Tick_isr(void) {
+    volatile FRAME *f;
+    if(++refresh_count >= refresh_div) {    //Show the next of the LEDs, U1 & U2 in turn every refresh_div ticks
+        refresh_count = 0;
+        f = &frame[multiplex_index];
+        LATH = f->lath;                     //Enable the display/LEDs,
+        LATA = f->lata;
+        LATF = f->latf;                     //then put the value to be displayed onto LATF
+        if(f->on_tcy != 0) {                //If it is dimmed, blank it on_tcy after this tick's compare (CCPR5 has already moved on to the next)
+            CCPR3 = CCPR5 - TICK_TCY + f->on_tcy;
+            PIR3bits.CCP3IF = 0;
+            CCP3CON = 0x0A;
+            if((signed short)(unsigned short)(CCPR3 - ReadTimer3()) <= 0) {   //Already past it if this ISR ran late, so blank it now. Timer3 wraps at 16 bits, however wide an int is
+                Blank_isr();
+            }
+        }
+        else {
+            CCP3CON = 0x00;
+        }
+        if(++multiplex_index >= 3) {
+            multiplex_index = 0;
+        }
+    }
+    ms_ticks++;                             //Increment millisecond tick count
+    DebounceButtons();                      //Sample push buttons
+    RadioSample();                          //and the radio time-code receiver
+    if(tone_on == 1) {                      //Count down the length of the note being played, and silence the buzzer when it has finished
+        if(--tone_ms == 0) {
+            CCP4CON = 0x00;
+            LATJbits.LATJ6 = 0;
+            tone_on = 0;
+        }
+    }
+    MelodyTick();                           //Play next note of alarm melody when due
+}
+
+void Blank_isr(void) {
+    CCP3CON = 0x00;                         //One blank each time a display is shown, set up by tick ISR
+    LATH = 0x00;                            //Disable the display/LEDs for the rest of its time
+    LATA = 0x00;
+}
+
+void PowerFail_isr(void) {
+    unsigned char snap[EE_SNAP_SIZE];
+    unsigned long e;
+    unsigned int crc = 0xFFFF;
+    char i, j, ovf, phase;
+    char adrh = EEADRH, adr = EEADR, data = EEDATA, wren = EECON1bits.WREN;   //The main loop may be part way through reading or writing the EEPROM
+    LATH = 0x00;                            //Blank the displays & stop the buzzer, so the supply holds up for longer
+    LATA = 0x00;
+    CCP4CON = 0x00;
+    PIE2bits.HLVDIE = 0;                    //Only one snapshot is taken. SaveStep() saves straight away & re-arms it if the supply recovers
+    do {
+        ovf = PIR1bits.TMR1IF;              //A second which has ended but not yet been counted is counted here, with the ticks since it ended
+        phase = TMR1H;
+    } while (ovf != PIR1bits.TMR1IF);
+    e = epoch_secs;
+    if (ovf == 1) {
+        e++;
+    } else {
+        phase = (phase >= tmr1_start) ? phase - tmr1_start : 0;    //The trim starts a second a count of TMR1H early or late
+    }
+    snap[0] = save_seq;                     //The record the snapshot follows on from. A save part way through is torn by the power cut
+    snap[1] = e & 0xFF;
+    snap[2] = (e >> 8) & 0xFF;
+    snap[3] = (e >> 16) & 0xFF;
+    snap[4] = e >> 24;
+    snap[5] = phase;                        //Units of 256 crystal ticks
+    for (i = 0; i < ((MAX_ALARMS + 7) / 8); i++) {
+        snap[6 + i] = 0;
+    }
+    for (i = 0; i < MAX_ALARMS; i++) {      //Alarms may have switched themselves off since the record was saved
+        if ((alarms[i].flags & ALARM_ON) != 0) {
+            snap[6 + (i >> 3)] |= 1 << (i & 0x07);
+        }
+    }
+    for (i = 0; i < EE_SNAP_SIZE - 2; i++) {    //CRC, read & write are done here rather than by Crc16(), EERead() & EEWrite(), so the ISR
+        crc ^= (unsigned int)snap[i] << 8;      //shares no code with the main loop
+        for (j = 0; j < 8; j++) {
+            if ((crc & 0x8000) != 0) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+    snap[EE_SNAP_SIZE - 2] = crc & 0xFF;
+    snap[EE_SNAP_SIZE - 1] = crc >> 8;
+    EECON1bits.EEPGD = 0;                   //Data EEPROM
+    EECON1bits.CFGS = 0;
+    for (i = 0; i < EE_SNAP_SIZE; i++) {    //At most EE_SNAP_SIZE + 1 writes (one may be in progress), so it takes at most (EE_SNAP_SIZE + 1) * 4ms
+        while (EECON1bits.WR == 1) {
         }
-        multiplex_index++;                  //Increment index & millisecond counters
-        ms_count0++;
-        ms_count1++;
-        ms_count2++;
-        ms_count3++;
+        EEADRH = (EE_SNAP_ADDR + i) >> 8;
+        EEADR = (EE_SNAP_ADDR + i) & 0xFF;
+        EECON1bits.RD = 1;
+        if (EEDATA != snap[i]) {
+            EEDATA = snap[i];
+            EECON1bits.WREN = 1;
+            EECON2 = 0x55;                  //Interrupts are already held off in a high-priority ISR, so the unlock sequence can't be broken into
+            EECON2 = 0xAA;
+            EECON1bits.WR = 1;
+        }
+    }
+    while (EECON1bits.WR == 1) {            //Let the last write finish, so a write the main loop starts on return doesn't land on top of it
+    }
+    EECON1bits.WREN = wren;                 //Put back a write the main loop was setting up in EEWrite(), or its unlock sequence is ignored
+    EEADRH = adrh;
+    EEADR = adr;
+    EEDATA = data;
+}
+
+void Tone_isr(void) {
+    CCPR4 += tone_half_period;              //Schedule the next toggle relative to this compare, not to when the ISR ran
+    LATJbits.LATJ6 ^= 1;                    //Toggle buzzer to generate a square wave
 }
 
 void enable_interrupts_all(void) {
@@ -416,979 +1219,1784 @@ void disable_interrupts_all(void) {
     INTCONbits.GIE = 0;
 }
 
-void StartTimer0(void) {
-    T0CON = 0x08;                   //Configure Timer0 as 16-bit, internal clock source, prescaler disabled, but don't turn it on yet
-    TMR0H = 0;                      //Clear timer registers
-    TMR0L = 0;
-    INTCONbits.TMR0IF = 0;          //Clear interrupt flag
-    INTCONbits.TMR0IE = 1;          //Enable Timer0 interrupt
-    INTCON2bits.TMR0IP = 0;         //Set as low-priority interrupt
-    T0CONbits.TMR0ON = 1;           //Turn on Timer0
-}
-
 void StartTimer1(void) {
-    T1CON = 0x8A;                   //Configure Timer1 as 16-bit, external clock source, 1:1 prescaler, enable oscillator power, don't synchronise clock, but don't turn it on yet
-    TMR1H = 0;                      //Clear timer registers
-    TMR1L = 0;
+    T1CON = 0x0E;                   //Configure Timer1 for 8-bit reads/writes (so TMR1H can be written on its own), external clock source, 1:1 prescaler, enable oscillator power, don't synchronise clock (so it counts in sleep), but don't turn it on yet
+                                    //TMR1H/TMR1L have been loaded by SetEpoch() with the time into the first second
     PIR1bits.TMR1IF = 0;            //Clear interrupt flag
     PIE1bits.TMR1IE = 1;            //Enable Timer1 interrupt
     IPR1bits.TMR1IP = 1;            //Set as high-priority interrupt
     T1CONbits.TMR1ON = 1;           //Turn on Timer1
 }
 
-void Num2Disp(volatile char *time) {
+void StartTimer3(void) {
+    T3CON = 0xC0;                   //Configure Timer3 as 16-bit, internal clock source, 1:1 prescaler, clock source for CCP3/4/5, but don't turn it on yet
+    TMR3H = 0;                      //Clear timer registers
+    TMR3L = 0;
+    CCP4CON = 0x00;                 //CCP4 off until a note is played
+    PIR3bits.CCP4IF = 0;            //Clear interrupt flag
+    PIE3bits.CCP4IE = 1;            //Enable CCP4 interrupt
+    IPR3bits.CCP4IP = 0;            //Set as low-priority interrupt
+    CCP3CON = 0x00;                 //CCP3 off until a dimmed display is shown
+    PIR3bits.CCP3IF = 0;
+    PIE3bits.CCP3IE = 1;            //Enable CCP3 interrupt
+    IPR3bits.CCP3IP = 0;            //Set as low-priority interrupt
+    CCPR5 = TICK_TCY;               //First tick 1ms after Timer3 is turned on
+    CCP5CON = 0x0A;                 //CCP5 in compare mode, generate software interrupt on match
+    PIR3bits.CCP5IF = 0;            //Clear interrupt flag
+    PIE3bits.CCP5IE = 1;            //Enable CCP5 interrupt
+    IPR3bits.CCP5IP = 0;            //Set as low-priority interrupt
+    T3CONbits.TMR3ON = 1;           //Turn on Timer3
+}
+
+void ToneStart(char note, unsigned int length) {
+    INTCONbits.PEIE = 0;                                //Disable low-priority interrupts while the tone generator is set up
+    ToneLoad(note, length);
+    INTCONbits.PEIE = 1;
+}
+
+void ToneLoad(char note, unsigned int length) {
+    tone_half_period = (unsigned int)note * TONE_TCY_PER_UNIT;
+    tone_ms = length;
+    tone_on = 1;
+    LATJbits.LATJ6 = 0;
+    CCPR4 = ReadTimer3() + tone_half_period;            //First toggle is one half-period from now
+    PIR3bits.CCP4IF = 0;
+    CCP4CON = 0x0A;                                     //Compare mode, generate software interrupt on match
+}
+
+void ToneStop(void) {
+    INTCONbits.PEIE = 0;
+    CCP4CON = 0x00;
+    LATJbits.LATJ6 = 0;
+    tone_on = 0;
+    INTCONbits.PEIE = 1;
+}
+
+char ToneBusy(void) {
+    return(tone_on);
+}
+
+void MelodyStart(const char *m) {
+    INTCONbits.PEIE = 0;                    //Disable low-priority interrupts while the sequencer is set up
+    melody = m;
+    melody_pos = 0;
+    melody_ms = 1;                          //First note is played on the next tick
+    INTCONbits.PEIE = 1;
+}
+
+void MelodyStop(void) {
+    INTCONbits.PEIE = 0;
+    melody = 0;
+    INTCONbits.PEIE = 1;
+    ToneStop();                             //Silence the note currently playing
+}
+
+void MelodyTick(void) {
+    char note, timing;
+    if(melody == 0 || --melody_ms != 0) {   //Nothing to do unless a melody is playing and its next step is due
+        return;
+    }
+    note = melody[melody_pos];
+    if(note == MELODY_END) {                //At the end of the table, wait before repeating the melody
+        melody_pos = 0;
+        melody_ms = ALARM_REPEAT_DELAY;
+        return;
+    }
+    timing = melody[melody_pos + 1];
+    melody_pos += 2;
+    melody_ms = (unsigned int)((timing >> 4) + 1 + (timing & 0x0F)) * SEMIQUAVER;   //Note length + gap
+    if(note != REST) {
+        ToneLoad(note, (unsigned int)((timing >> 4) + 1) * SEMIQUAVER);
+    }
+}
+
+void Num2Disp(char bcd) {
     char tens, units;               //Two temporary variables to store use as indexes for DispNums[] array
-    if(*time > 99) {
-        disp_U1 = DispChars.r;      //Display error code 0x01 on LEDs if value is outside range as numbers greater than this cannot be displayed on the 7-segment displays
+    tens = bcd >> 4;                //The tens & units are the high & low nibbles, so no division is needed
+    units = bcd & 0x0F;
+    if((tens > 9) || (units > 9)) {
+        disp_U1 = DispChars.r & dp_mask;      //Display error code 0x01 on LEDs if either digit isn't 0-9, as it cannot be displayed on the 7-segment displays
         disp_U2 = DispChars.E;
         disp_LEDS = 0x01;
         return;
     }
     else {
-        tens = *time / 10;          //If number is in the range, calculate the tens & units components
-        units = *time % 10;         //using the modulo operator
-        disp_U2 = DispNums[tens];   //and copy the bit patterns from DispNums[] corresponding to these integers
-        disp_U1 = DispNums[units];  //to the U1 & U2 current display variables
+        disp_U2 = DispNums[tens];   //Copy the bit patterns from DispNums[] corresponding to the digits
+        disp_U1 = DispNums[units] & dp_mask;  //to the U1 & U2 current display variables
         return;
     }
 }
 
+char Bin2Bcd(char n) {
+    char tens;
+    if(n > 99) {
+        return(0xFF);               //Not two digits, so Num2Disp() will show error 1
+    }
+    tens = ((unsigned int)n * 205) >> 11;       //n / 10, exact for n < 1029
+    return((tens << 4) | (n - (tens << 3) - (tens << 1)));
+}
+
+char BcdInc(char *bcd, char last) {
+    if(*bcd == last) {
+        *bcd = 0x00;
+        return(1);
+    }
+    (*bcd)++;
+    if((*bcd & 0x0F) == 0x0A) {     //Decimal adjust: carry from the units into the tens
+        *bcd += 0x06;
+    }
+    return(0);
+}
+
 void CurrentDisplay(char *i) {
+    UpdateMainTime();
     switch(*i) {                                //Display either dd/mm/yy hh:mm:ss on displays & LEDs as dictated by the index, i, passed into it
         case(0) : 
-            Num2Disp(&MainDate.day);
+            Num2Disp(MainClock.day);
             disp_LEDS = DAY;
             break;
         case(1) :
-            Num2Disp(&MainDate.month);
+            Num2Disp(MainClock.month);
             disp_LEDS = MONTH;
             break;
         case(2) :
-            Num2Disp(&MainDate.year_short);
+            Num2Disp(MainClock.year);
             disp_LEDS = YEAR;
             break;
         case(3) :
-            Num2Disp(&MainTime.hrs);
+            Num2Disp(MainClock.hrs);
             disp_LEDS = HRS;
             break;
         case(4) :
-            Num2Disp(&MainTime.mins);
+            Num2Disp(MainClock.mins);
             disp_LEDS = MINS;
             break;
         case(5) :
-            Num2Disp(&MainTime.secs);
+            Num2Disp(MainClock.secs);
             disp_LEDS = SECS;
             break;
         default :
             disp_U2 = DispChars.E;
-            disp_U1 = DispChars.r;
+            disp_U1 = DispChars.r & dp_mask;
             disp_LEDS = 0x03;
             break;
     }
 }
 
-char Switches(void) {           
-    char temp, temp1, temp2; 
-    temp1 = PORTC;              //Using bit shifting & masking operations, returns the value of the toggle switches
-    temp1 >>= 2;
-    temp1 &= 0x0F;
-    temp2 = PORTH;
-    temp2 &= 0xF0;
-    temp = (temp1 | temp2);
-    return(temp);
-}
-
-void SetMenu(void) {
-    while (Switches() != 0x00) {                //This function implements the main setting menu to set date/time & alarms, based upon the combination of toggle
-        switch (Switches()) {                   //switches set. For all date/time set operations, the 1Hz RTC is disabled to 'freeze' the time, and is re-enabled
-            case(SECS):                         //upon exiting the set routine. Comments are given for the seconds & Alarm1 cases, other cases are similar
-                PIE1bits.TMR1IE = 0;            //Disable Timer1 interrupt to 'freeze' time
-                SecsFlash();                    //Flash 'SS' on displays to show user seconds set mode has been entered
-                Num2Disp(&MainTime.secs);       //Display the current seconds value of the Main RTC time on the displays
-                while (Switches() == SECS) {    //Stay in the seconds set routine while toggle switches are set to indicate this
-                    SetSecs(&MainTime);         //Set seconds member of MainTime by passing in address of MainTime (saves time & processor resources)
-                    Num2Disp(&MainTime.secs);   //Update the display with the new MainTime.secs value as it is changed by the user
-                }
-                PIE1bits.TMR1IE = 1;            //Re-enable 1Hz RTC interrupt to 'un-freeze' time
-                break;
-            case(MINS):
-                PIE1bits.TMR1IE = 0;
-                MinsFlash();
-                Num2Disp(&MainTime.mins);
-                while (Switches() == MINS) {
-                    SetMins(&MainTime);
-                    Num2Disp(&MainTime.mins);
-                }
-                PIE1bits.TMR1IE = 1;
-                break;
-            case(HRS):
-                PIE1bits.TMR1IE = 0;
-                HrsFlash();
-                Num2Disp(&MainTime.hrs);
-                while (Switches() == HRS) {
-                    SetHrs(&MainTime);
-                    Num2Disp(&MainTime.hrs);
-                }
-                PIE1bits.TMR1IE = 1;
-                break;
-            case(DAY):
-                PIE1bits.TMR1IE = 0;
-                DayFlash();
-                Num2Disp(&MainDate.day);
-                while (Switches() == DAY) {
-                    SetDay(&MainDate);
-                    Num2Disp(&MainDate.day);
-                }
-                PIE1bits.TMR1IE = 1;
-                break;
-            case(MONTH):
-                PIE1bits.TMR1IE = 0;
-                MonthFlash();
-                Num2Disp(&MainDate.month);
-                while (Switches() == MONTH) {
-                    SetMonth(&MainDate);
-                    Num2Disp(&MainDate.month);
-                }
-                PIE1bits.TMR1IE = 1;
-                break;
-            case(YEAR):
-                PIE1bits.TMR1IE = 0;
-                YearFlash();
-                Num2Disp(&MainDate.year_short);
-                while (Switches() == YEAR) {
-                    SetYear(&MainDate);
-                    Num2Disp(&MainDate.year_short);
-                }
-                PIE1bits.TMR1IE = 1;
-                break;
-            case(ALARM1):                           //Enter alarm set mode if switches are set accordingly
-                Alarm1Flash();                      //Flash 'A1' on displays to show user alarm set mode has been entered
-                while ((Switches() >> 7) == 1) {    //While bit 7 of switches remains set, remain in alarm set mode
-                    SetAlarm1();                    //Set alarm 1
-                }
-                break;
-            case(ALARM2):
-                Alarm2Flash();
-                while ((Switches() >> 6) == 1) {
-                    SetAlarm2();
-                }
-                break;
-            default:
-                disp_U2 = DispChars.E;              //Default case if other switch combinations are used which don't correspond to menu options
-                disp_U1 = DispChars.r;              //Display error code 2 to indicate this to user. Clock remains running in background.
-                disp_LEDS = 0x02;
-                break;
+void StepDisplay(signed char step) {
+    if (step > 0) {
+        if (disp_index < 5) {
+            disp_index++;
+        } else {
+            disp_index = 0;
+        }
+    } else {
+        if (disp_index > 0) {
+            disp_index--;
+        } else {
+            disp_index = 5;
         }
     }
+    disp_dirty |= DIRTY_INDEX;
 }
 
-char PB1pressed(void) {
-    if(PORTJbits.RJ5 == 0) {
-        ms_count1 = 0;
-        while(ms_count1 < DEBOUNCE_DELAY) {
-        }
-        if(PORTJbits.RJ0 == 0) {
-            return(1);
-        }
-        else {
-            return(0);
-        }
-    }
-    else {
-        return(0);
-    }
+char AddTask(void (*run)(void), unsigned int period) {
+    tasks[n_tasks].run = run;
+    tasks[n_tasks].period = period;
+    tasks[n_tasks].last = GetTicks();       //First run is one period from now
+    return(n_tasks++);
 }
 
-char PB2pressed(void) {
-    if(PORTBbits.RB0 == 0) {
-        ms_count1 = 0;
-        while(ms_count1 < DEBOUNCE_DELAY) {
-        }
-        if(PORTBbits.RB0 == 0) {
-            return(1);
-        }
-        else {
-            return(0);
+void RestartTask(char task) {
+    tasks[task].last = GetTicks();
+}
+
+void RunTasks(void) {
+    unsigned int now;
+    char i;
+    now = GetTicks();
+    for (i = 0; i < n_tasks; i++) {
+        if ((unsigned int)(now - tasks[i].last) >= tasks[i].period) {
+            tasks[i].last += tasks[i].period;                           //Keep to the task's own schedule, so that its timing doesn't drift
+            if ((unsigned int)(now - tasks[i].last) >= tasks[i].period) {
+                tasks[i].last = now;                                    //If it has fallen more than a period behind (e.g. while in the setting menu), skip the missed runs
+            }
+            tasks[i].run();
         }
     }
-    else {
-        return(0);
-    }
 }
 
-void ConfigureIO(void) {
-    ADCON1 = 0x3F;
-    TRISF = 0x00;
-    TRISH = 0xFC;
-    TRISA = 0xEF;
-    TRISB = 0xFF;
-    TRISC = 0xFF;
-    TRISJ = 0xBF; 
+unsigned int GetTicks(void) {
+    unsigned int t;
+    do {
+        t = ms_ticks;                       //Re-read if tick ISR changed ms_ticks part way through reading it
+    } while (t != ms_ticks);
+    return(t);
 }
 
-void BootTest(void) {
-    disp_LEDS = 0xFF;
-    disp_U1 = 0x00;
-    disp_U2 = 0x00;
-    while (ms_count3 <= SEMIBREVE) {
-        LATJbits.LATJ6 = 1;
-        Delay10TCYx(C5);
-        Delay10TCYx(C5);
-        LATJbits.LATJ6 = 0;
-        Delay10TCYx(C5);
-        Delay10TCYx(C5);
-    }
-    disp_LEDS = 0x00;
-    disp_U1 = 0xFF;
-    disp_U2 = 0xFF;
-    Delay10KTCYx(250);
+void DisplayCycleTask(void) {
+    StepDisplay(1);
 }
 
-void CalcTime(void) {
-    char mins_temp = 0; 
-    mins_temp = MainTime.mins + mins_rollover;
-    if (mins_temp < 59) {
-        MainTime.mins = mins_temp;
+void DimTask(void) {
+    char mode;
+    UpdateMainTime();
+    if (idle_secs >= DIM_TIMEOUT) {
+        mode = DIM_IDLE;
+    } else if ((MainClock.hrs >= DIM_FROM_HRS) || (MainClock.hrs < DIM_TO_HRS)) {    //Packed BCD compares in the same order as binary
+        mode = DIM_NIGHT;
+    } else {
+        mode = DIM_DAY;
     }
-    else {
-        MainTime.mins = mins_temp - 60;
-        if (MainTime.hrs < 23) {
-            MainTime.hrs++;
+    if (mode != dim_mode) {             //Only work out the blanking times when the mode changes
+        dim_mode = mode;
+        SetDisplayLevels(DimLevels[mode], DimRefresh[mode]);
+    }
+}
+
+void SetDisplayLevels(const char *levels, char div) {
+    char i;
+    unsigned int on;
+    INTCONbits.PEIE = 0;                //Tick ISR reads on_tcy & refresh_div, so change them together with it disabled
+    for (i = 0; i < 3; i++) {
+        if (levels[i] >= BRIGHT_LEVELS) {
+            frame[i].on_tcy = 0;        //Fully on, never blanked
         } else {
-            MainTime.hrs = 0;
-            day_rollover = 1;
+            on = (unsigned int)levels[i] * div * (TICK_TCY / BRIGHT_LEVELS);
+            frame[i].on_tcy = (on != 0) ? on : 1;   //Off (level 0) is blanked straight away
         }
     }
-    mins_rollover = 0;
+    refresh_div = div;
+    refresh_count = 0;
+    INTCONbits.PEIE = 1;
 }
 
-void CalcDate(void) {
-    day_rollover = 0;
-    if(CalcLeapYear(MainDate.year_long) == 0) {
-        if(MainDate.day < DaysInMonth[MainDate.month]) {
-            MainDate.day++;
-        }
-        else {
-            MainDate.day = 1;
-            if(MainDate.month < 12) {
-                MainDate.month++;
-            }
-            else {
-                MainDate.month = 1;
-                if(MainDate.year_long < 99) {
-                    MainDate.year_long++;
-                    MainDate.year_short++;
-                }
-                else {
-                    MainDate.year_long = 2000;
-                    MainDate.year_short = 00;
-                }
-                
-            }
+void ButtonTask(void) {
+    if (alarm_sounding != 0) {              //If an alarm is sounding, a press of PB1/PB2 acknowledges it
+        if (PB1pressed() || PB2pressed()) {
+            AcknowledgeAlarm();
         }
+        return;
     }
-    else {
-       if(MainDate.day < DaysInMonthLeap[MainDate.month]) {
-            MainDate.day++;
-        }
-        else {
-            MainDate.day = 1;
-            if(MainDate.month < 12) {
-                MainDate.month++;
-            }
-            else {
-                MainDate.month = 1;
-                MainDate.year_long++;
-                MainDate.year_short++;
-            }
-        }
+    if (menu_state != MENU_OFF) {           //Otherwise PB1/PB2 set values in the setting menu, see MenuTask()
+        return;
+    }
+    if (PB1pressed() == 1) {                //If PB1 is held, cycle forwards through dd/mm/yy hh:mm:ss on display
+        RestartTask(display_task);
+        StepDisplay(1);
+    }
+    else if (PB2pressed() == 1) {           //If PB2 is held, cycle backwards
+        RestartTask(display_task);
+        StepDisplay(-1);
     }
 }
 
-char CalcLeapYear(unsigned int year) {
-    if((year % 4) == 0) {
-        if((year % 100) == 0) {
-            if ((year % 400) == 0) {
-                return(1);
-            }
-            else {
-                return(0);
-            }
-        }
-        else {
-            return(1);
+void AcknowledgeAlarm(void) {
+    MelodyStop();
+    alarm_sounding = 0;
+    disp_dirty |= DIRTY_SCREEN;     //The alarm no. is still on the displays
+}
+
+void ScheduleAlarms(unsigned long from) {
+    char i, j;
+    for (i = 0; i < MAX_ALARMS; i++) {
+        alarm_fire[i] = AlarmNextFire(i, from);
+        for (j = i; (j > 0) && (alarm_fire[alarm_order[j - 1]] > alarm_fire[i]); j--) {    //Insert the alarm into alarm_order after those due sooner
+            alarm_order[j] = alarm_order[j - 1];
         }
+        alarm_order[j] = i;
     }
-    else {
-        return(0);
-    }
+    LoadNextAlarm();
 }
 
-void SetSecs(volatile TIME *ts) {
-    if(PB2pressed() && ts->secs < 59) {
-        ts->secs++;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if(PB2pressed() && ts->secs == 59) {
-        ts->secs =  0;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if(PB1pressed() && ts->secs > 0) {
-        ts->secs--;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+void SoundNextAlarm(void) {
+    char n, i;
+    unsigned long at, now;
+    n = alarm_order[0];
+    at = alarm_fire[n];
+    now = GetEpoch();
+    SoundAlarm(n);
+    counters[COUNT_ALARMS]++;
+    if (alarms[n].repeat == 0) {                //Alarms which don't repeat switch themselves off once they have gone off
+        alarms[n].flags &= ~ALARM_ON;
+        SaveLater();
     }
-    if(PB1pressed() && ts->secs == 0) {
-        ts->secs = 59;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    alarm_fire[n] = AlarmNextFire(n, ((now > at) ? now : at) + 1);     //After this time, or now if it was kept due from before the time was moved on
+    for (i = 0; (i < MAX_ALARMS - 1) && (alarm_fire[alarm_order[i + 1]] <= alarm_fire[n]); i++) {    //Move it down the list past the alarms now due sooner
+        alarm_order[i] = alarm_order[i + 1];
     }
+    alarm_order[i] = n;
+    LoadNextAlarm();
 }
 
-void SetMins(volatile TIME *tm) {
-    if(PB2pressed() && tm->mins < 59) {
-        tm->mins++;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if(PB2pressed() && tm->mins == 59) {
-        tm->mins = 0;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if(PB1pressed() && tm->mins > 0) {
-        tm->mins--;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if(PB1pressed() && tm->mins == 0) {
-        tm->mins = 59;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+void LoadNextAlarm(void) {
+    PIE1bits.TMR1IE = 0;                        //Stop Timer1 ISR comparing against alarm_epoch while it is being written
+    alarm_epoch = alarm_fire[alarm_order[0]];
+    if (alarm_epoch <= epoch_secs) {            //If it is already due (e.g. two alarms at the same time), Timer1 ISR won't see it, so mark it as due here
+        alarm_due = 1;
+    } else {
+        alarm_due = 0;
     }
+    PIE1bits.TMR1IE = 1;
 }
 
-void SetHrs(volatile TIME *th) {
-    if(PB2pressed() && th->hrs < 23) {
-        th->hrs++;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+unsigned long AlarmNextFire(char n, unsigned long from) {
+    unsigned long t;
+    unsigned int day;
+    char i;
+    if ((alarms[n].flags & ALARM_ON) == 0) {
+        return(NO_ALARM);
     }
-    if(PB2pressed() && th->hrs == 23) {
-        th->hrs = 0;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    if ((alarms[n].flags & ALARM_DATED) != 0) {                 //Dated alarms are due once, at their date & time, unless that has passed
+        t = DateToEpoch(&alarms[n].date, &alarms[n].time);
+        if (t < from) {
+            return(NO_ALARM);
+        }
+        return(t);
     }
-    if(PB1pressed() && th->hrs > 0) {
-        th->hrs--;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    day = EpochDays(from);                                      //Other alarms are next due today, or tomorrow if that time has passed,
+    t = ((unsigned long)day * SECS_PER_DAY) + ((unsigned long)alarms[n].time.hrs * 3600) + ((unsigned int)alarms[n].time.mins * 60) + alarms[n].time.secs;
+    if (t < from) {
+        day++;
+        t += SECS_PER_DAY;
     }
-    if(PB1pressed() && th->hrs == 0) {
-        th->hrs = 23;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    if (alarms[n].repeat != 0) {                                //or on the next weekday they repeat on
+        for (i = 0; (i < 7) && ((alarms[n].repeat & (1 << Weekday(day))) == 0); i++) {
+            day++;
+            t += SECS_PER_DAY;
+        }
     }
+    return(t);
+}
+
+unsigned long GetEpoch(void) {
+    unsigned long t;
+    unsigned char seq;
+    do {
+        seq = rtc_seq;
+        t = epoch_secs;
+    } while (seq != rtc_seq);               //Copy it again if Timer1 ISR counted a second part way through copying it
+    return(t);
 }
 
-void SetDay(volatile DATE *dd) {
-    if(CalcLeapYear(dd->year_long) == 1) {
-        if(PB2pressed() && dd->day < DaysInMonthLeap[dd->month]) {
-            dd->day++;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+void SetEpoch(unsigned long e, unsigned int ticks) {
+    char ie = PIE1bits.TMR1IE;
+    char pps = INTCON3bits.INT1IE;
+    char on = T1CONbits.TMR1ON;
+    PIE1bits.TMR1IE = 0;                    //Timer1 ISR mustn't count a second part way through the write,
+    INTCON3bits.INT1IE = 0;                 //nor the PPS ISR note where it is
+    T1CONbits.TMR1ON = 0;                   //Timer1 is clocked asynchronously, so stop it while it is written
+    TMR1H = TIMER1_HIGH | (ticks >> 8);     //Second e is ticks in, and the next is counted 2^15 crystal ticks after it started
+    TMR1L = ticks & 0xFF;
+    tmr1_start = TIMER1_HIGH;
+    PIR1bits.TMR1IF = 0;                    //A second which was about to be counted is replaced by this one
+    T1CONbits.TMR1ON = on;
+    epoch_secs = e;
+    rtc_seq++;
+    INTCON3bits.INT1IE = pps;
+    PIE1bits.TMR1IE = ie;
+}
+
+void ShiftEpoch(unsigned long by) {
+    char ie = PIE1bits.TMR1IE;
+    char pps = INTCON3bits.INT1IE;
+    PIE1bits.TMR1IE = 0;                    //Timer1 ISR mustn't count a second part way through the add, nor the PPS ISR read it
+    INTCON3bits.INT1IE = 0;
+    epoch_secs += by;
+    rtc_seq++;
+    INTCON3bits.INT1IE = pps;
+    PIE1bits.TMR1IE = ie;
+}
+
+char LoadSettings(void) {
+    unsigned char seqs[EE_SLOTS];
+    unsigned char snap[EE_SNAP_SIZE];
+    unsigned int addr, i, crc;
+    unsigned long e, ticks;
+    char s, newest, loaded;
+    for (s = 0; s < EE_SLOTS; s++) {            //Read the sequence no. of each slot once
+        seqs[s] = EERead((unsigned int)s * EE_SLOT_SIZE);
+    }
+    PIR2bits.EEIF = 0;                          //EEIF wakes the PIC in standby when each byte saved has been written
+    IPR2bits.EEIP = 0;
+    PIE2bits.EEIE = 1;
+    while (1) {
+        newest = EE_SLOTS;                      //Find the newest slot not yet rejected. The sequence nos. wrap around, so compare them by difference
+        for (s = 0; s < EE_SLOTS; s++) {
+            if ((seqs[s] != EE_EMPTY) && ((newest == EE_SLOTS) || ((signed char)(seqs[s] - seqs[newest]) > 0))) {
+                newest = s;
+            }
+        }
+        if (newest == EE_SLOTS) {               //No valid record (e.g. the EEPROM is erased), so start from the defaults & save to slot 0 first
+            break;
         }
-        if(PB2pressed() && dd->day == DaysInMonthLeap[dd->month]) {
-            dd->day = 1;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+        addr = (unsigned int)newest * EE_SLOT_SIZE;
+        crc = 0xFFFF;
+        for (i = 0; i < sizeof(SAVED); i++) {
+            ((char *)&save_buf)[i] = EERead(addr + i);
+            crc = Crc16(crc, ((char *)&save_buf)[i]);
         }
-        if(PB1pressed() && dd->day > 1) {
-            dd->day--;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+        if ((EERead(addr + i) == (crc & 0xFF)) && (EERead(addr + i + 1) == (crc >> 8))) {
+            break;
         }
-        if(PB1pressed() && dd->day == 1) {
-            dd->day = DaysInMonth[MainDate.month];
-            Delay10KTCYx(KEY_REPEAT_DELAY);
-       }
+        seqs[newest] = EE_EMPTY;                //Torn by a reset part way through saving it, so fall back to the one before
     }
-    else {
-        if(PB2pressed() && dd->day < DaysInMonthLeap[dd->month]) {
-            dd->day++;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+    loaded = LOAD_NONE;
+    if (newest != EE_SLOTS) {
+        loaded = LOAD_SAVED;
+        save_seq = save_buf.seq;
+        save_slot = newest;
+        for (s = 0; s < MAX_ALARMS; s++) {
+            alarms[s] = save_buf.alarms[s];
         }
-        if(PB2pressed() && dd->day == DaysInMonth[dd->month]) {
-            dd->day = 1;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+        rtc_trim = save_buf.rtc_trim;
+        SetEpoch(save_buf.epoch, 0);
+    }
+    crc = 0xFFFF;                               //The snapshot is restored only if it follows on from the record restored, as it is
+    for (i = 0; i < EE_SNAP_SIZE; i++) {        //never erased, and isn't restored again once a newer record has been saved
+        snap[i] = EERead(EE_SNAP_ADDR + i);
+        if (i < EE_SNAP_SIZE - 2) {
+            crc = Crc16(crc, snap[i]);
         }
-        if(PB1pressed() && dd->day > 1) {
-            dd->day--;
-            Delay10KTCYx(KEY_REPEAT_DELAY);
+    }
+    e = snap[1] | ((unsigned long)snap[2] << 8) | ((unsigned long)snap[3] << 16) | ((unsigned long)snap[4] << 24);
+    if ((snap[EE_SNAP_SIZE - 2] != (crc & 0xFF)) || (snap[EE_SNAP_SIZE - 1] != (crc >> 8)) || (snap[0] != save_seq) ||
+        ((loaded == LOAD_SAVED) && (e < save_buf.epoch))) {
+        return(loaded);
+    }
+    for (s = 0; s < MAX_ALARMS; s++) {
+        if ((snap[6 + (s >> 3)] & (1 << (s & 0x07))) != 0) {
+            alarms[s].flags |= ALARM_ON;
+        } else {
+            alarms[s].flags &= ~ALARM_ON;
         }
-        if(PB1pressed() && dd->day == 1) {
-            dd->day = DaysInMonth[MainDate.month];
-            Delay10KTCYx(KEY_REPEAT_DELAY);
-       }
     }
-
-
+    ticks = ((unsigned long)snap[5] << 8) + ((DOWNTIME_MS * 32768UL) / 1000);   //Carry on from the snapshot, plus the estimate of the downtime
+    SetEpoch(e + (ticks >> 15), ticks & 0x7FFF);
+    return(LOAD_SNAPSHOT);
 }
 
-void SetMonth(volatile DATE *dm) {
-    if (PB2pressed() && dm->month < 12) {
-        dm->month++;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+void StartHLVD(void) {
+    HLVDCON = HLVD_LEVEL;                       //Trip when the supply falls (VDIRMAG clear) below HLVD_LEVEL
+    HLVDCONbits.HLVDEN = 1;
+    while (HLVDCONbits.IRVST == 0) {            //Wait for the internal reference to settle, or it may trip straight away
     }
-    if (PB2pressed() && dm->month == 12) {
-        dm->month = 1;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if (PB1pressed() && dm->month > 1) {
-        dm->month--;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
-    }
-    if (PB1pressed() && dm->month == 1) {
-        dm->month = 12;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    PIR2bits.HLVDIF = 0;
+    IPR2bits.HLVDIP = 1;                        //Set as high-priority interrupt, so the snapshot is written as soon as it trips
+    PIE2bits.HLVDIE = 1;
+}
+
+void SaveLater(void) {
+    unsigned long at = GetEpoch() + SAVE_DELAY;
+    if (at < save_at) {                         //Unless a save is already due sooner
+        save_at = at;
     }
 }
 
-void SetYear(volatile DATE *dy) {
-    if (PB2pressed() && dy->year_long < 2099) {
-        dy->year_long++;
-        dy->year_short++;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+void SaveStep(void) {
+    unsigned int addr;
+    char n, b;
+    if (EECON1bits.WR == 1) {                   //The last byte is still being written
+        return;
     }
-    if (PB2pressed() && dy->year_long == 2099) {
-        dy->year_long = 2000;
-        dy->year_short = 00;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    if (save_pos == SAVE_IDLE) {
+        if ((GetEpoch() < save_at) && (PIE2bits.HLVDIE == 1)) { //Save straight away if the supply failed & recovered, as the snapshot is now stale
+            return;
+        }
+        save_buf.seq = (save_seq + 1 == EE_EMPTY) ? 0 : save_seq + 1;    //Take a copy of the settings to save, so they can't change part way through
+        save_buf.epoch = GetEpoch();
+        save_buf.rtc_trim = rtc_trim;
+        for (n = 0; n < MAX_ALARMS; n++) {
+            save_buf.alarms[n] = alarms[n];
+        }
+        save_slot = (save_slot + 1 < EE_SLOTS) ? save_slot + 1 : 0;     //Overwrite the oldest slot, so the newest is kept if this save is torn
+        save_pos = 0;
+        save_crc = 0xFFFF;
+        save_at = save_buf.epoch + SAVE_PERIOD;
     }
-    if (PB1pressed() && dy->year_long > 2000) {
-        dy->year_long--;
-        dy->year_short--;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    addr = (unsigned int)save_slot * EE_SLOT_SIZE;
+    for (n = 0; (n < SAVE_CHUNK) && (save_pos < EE_SLOT_SIZE); n++) {
+        if (save_pos < sizeof(SAVED)) {         //The record, then its CRC (low byte first)
+            b = ((char *)&save_buf)[save_pos];
+            save_crc = Crc16(save_crc, b);
+        } else if (save_pos == sizeof(SAVED)) {
+            b = save_crc & 0xFF;
+        } else {
+            b = save_crc >> 8;
+        }
+        save_pos++;
+        if (EERead(addr + save_pos - 1) != b) { //Only bytes which have changed are written, which saves wear & time
+            EEWrite(addr + save_pos - 1, b);
+            return;
+        }
     }
-    if (PB1pressed() && dy->year_long == 2000) {
-        dy->year_long = 2099;
-        dy->year_short = 99;
-        Delay10KTCYx(KEY_REPEAT_DELAY);
+    if (save_pos >= EE_SLOT_SIZE) {
+        save_seq = save_buf.seq;
+        save_pos = SAVE_IDLE;
+        counters[COUNT_SAVES]++;
+        PIR2bits.HLVDIF = 0;                    //The snapshot is superseded, so another can be taken
+        PIE2bits.HLVDIE = 1;
     }
 }
 
-void SecsFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= SECS;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.S;
-    disp_U1 = DispChars.S;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.S;
-    disp_U1 = DispChars.S;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+char SaveBusy(void) {
+    return((save_pos != SAVE_IDLE) || (EECON1bits.WR == 1));
 }
 
-void MinsFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= MINS;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.M;
-    disp_U1 = DispChars.i;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.M;
-    disp_U1 = DispChars.i;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+unsigned int Crc16(unsigned int crc, char b) {
+    char i;
+    crc ^= (unsigned int)b << 8;
+    for (i = 0; i < 8; i++) {
+        if ((crc & 0x8000) != 0) {
+            crc = (crc << 1) ^ 0x1021;
+        } else {
+            crc <<= 1;
+        }
+    }
+    return(crc & 0xFFFF);
 }
 
-void HrsFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= HRS;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.h;
-    disp_U1 = DispChars.h;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.h;
-    disp_U1 = DispChars.h;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+unsigned char EERead(unsigned int addr) {
+    EEADRH = addr >> 8;
+    EEADR = addr & 0xFF;
+    EECON1bits.EEPGD = 0;                       //Data EEPROM, not flash program memory or the configuration bits
+    EECON1bits.CFGS = 0;
+    EECON1bits.RD = 1;
+    return(EEDATA);
 }
 
-void DayFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= DAY;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.d;
-    disp_U1 = DispChars.d;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.d;
-    disp_U1 = DispChars.d;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+void EEWrite(unsigned int addr, char b) {
+    char gie = INTCONbits.GIE;
+    EEADRH = addr >> 8;
+    EEADR = addr & 0xFF;
+    EEDATA = b;
+    EECON1bits.EEPGD = 0;
+    EECON1bits.CFGS = 0;
+    EECON1bits.WREN = 1;
+    INTCONbits.GIE = 0;                         //The unlock sequence must not be interrupted
+    EECON2 = 0x55;
+    EECON2 = 0xAA;
+    EECON1bits.WR = 1;                          //Takes about 4ms, then EEIF is set
+    INTCONbits.GIE = gie;
+    EECON1bits.WREN = 0;
 }
 
-void MonthFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS &= MONTH;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.M;
-    disp_U1 = DispChars.o;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.M;
-    disp_U1 = DispChars.o;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+char PowerSave(char mode) {
+    char reason;
+    OSCCONbits.IDLEN = mode;            //Idle stops only the CPU, sleep also stops the primary oscillator (and so Timer3, the tick & the tone generator)
+    Sleep();                            //Wait here until an enabled interrupt wakes the PIC. Its ISR runs before carrying on
+    Nop();
+    INTCONbits.GIE = 0;                 //Read & clear the reasons together, so none set by an ISR in between are lost. Ones set since the last
+    reason = wake_reason;               //call (before sleeping) are returned too, so the caller can still act on them
+    wake_reason = 0;
+    INTCONbits.GIE = 1;
+    return(reason);
 }
 
-void YearFlash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= YEAR;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.y;
-    disp_U1 = DispChars.y;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.y;
-    disp_U1 = DispChars.y;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
+void Standby(void) {
+    char reason;
+    PIE3bits.CCP5IE = 0;                //Stop the tick, so nothing is multiplexed onto the displays, and blank them
+    CCP3CON = 0x00;
+    LATH = 0x00;
+    LATA = 0x00;
+    INTCON2bits.INTEDG0 = 0;            //Wake on PB2 (INT0, active-low) being pressed
+    INTCONbits.INT0IF = 0;
+    INTCONbits.INT0IE = 1;
+    INTCON3bits.INT1IE = 0;             //No NMEA is received in sleep, so the PPS would only wake the PIC for nothing. rtc_trim holds the frequency
+    while (1) {
+        SaveStep();                     //The periodic save is made in standby too. EEIF wakes the PIC as each byte is written
+        BAUDCON1bits.WUE = 1;           //The EUSART can't receive while the oscillator is stopped, so wake on the start of the next byte instead
+        reason = PowerSave(POWER_SLEEP);    //Sleep until Timer1 ISR has counted the next second, PB2 is pressed or a byte starts on the UART
+        BAUDCON1bits.WUE = 0;
+        if (reason & (WAKE_BUTTON | WAKE_UART)) {   //The byte which woke it is lost, so the host must send something before its first command
+            break;
+        }
+        if ((PORTJbits.RJ5 == 0) || (PORTBbits.RB0 == 0) || (Switches() != 0x00) || (alarm_due == 1)) {
+            break;                      //PB1 & the toggle switches can't wake the PIC, so they are checked each second
+        }
+    }
+    INTCONbits.INT0IE = 0;
+    INTCON3bits.INT1IF = 0;
+    INTCON3bits.INT1IE = 1;
+    idle_secs = 0;
+    INTCONbits.PEIE = 0;                //Restart the tick from now. Timer3 stopped while asleep, and CCP5 may have matched in between
+    CCPR5 = ReadTimer3() + TICK_TCY;
+    PIR3bits.CCP5IF = 0;
+    PIE3bits.CCP5IE = 1;
+    INTCONbits.PEIE = 1;
 }
 
-void Alarm1Flash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= ALARM1;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[1];
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[1];
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH); 
+void StartUart(void) {
+    SPBRGH1 = UART_BRG >> 8;
+    SPBRG1 = UART_BRG & 0xFF;
+    BAUDCON1 = 0x08;                //16-bit baud rate generator (BRG16), idle high, no auto-baud or wake-up
+    TXSTA1 = 0x24;                  //8-bit, transmit enabled, asynchronous, high speed (BRGH)
+    RCSTA1 = 0x90;                  //Serial port enabled (RC6/RC7, which TRISC leaves as inputs for the EUSART), 8-bit, continuous receive
+    IPR1bits.RC1IP = 0;             //Set as low-priority interrupts
+    IPR1bits.TX1IP = 0;
+    PIE1bits.TX1IE = 0;             //Turned on by UartSend() when there is something to send
+    PIE1bits.RC1IE = 1;
+}
+
+void Uart_rx_isr(void) {
+    unsigned char next;
+    if (RCSTA1bits.OERR == 1) {     //The EUSART's own buffer overran, which stops it receiving until CREN is cleared
+        RCSTA1bits.CREN = 0;
+        RCSTA1bits.CREN = 1;
+        uart_overruns++;
+    }
+    next = (rx_head + 1) & (UART_RX_SIZE - 1);
+    if (next != rx_tail) {
+        rx_buf[rx_head] = RCREG1;
+        rx_head = next;             //Written after the byte, so UartTask() never reads it before it is there
+    } else {
+        next = RCREG1;              //The buffer is full, so the byte is lost
+        uart_overruns++;
+    }
+}
+
+void Uart_tx_isr(void) {
+    if (tx_tail != tx_head) {
+        TXREG1 = tx_buf[tx_tail];
+        tx_tail = (tx_tail + 1) & (UART_TX_SIZE - 1);
+    } else {
+        PIE1bits.TX1IE = 0;
+    }
+}
+
+void UartTask(void) {
+    unsigned int now = GetTicks();
+    unsigned char b;
+    if ((uart_pos != 0) && ((unsigned int)(now - uart_last) >= UART_TIMEOUT)) {
+        uart_pos = 0;               //The rest of the frame hasn't come, so drop it
+        counters[COUNT_ERRORS]++;
+    }
+    while (rx_tail != rx_head) {
+        b = rx_buf[rx_tail];
+        rx_tail = (rx_tail + 1) & (UART_RX_SIZE - 1);
+        uart_last = now;
+        if ((uart_pos == 0) && (b != UART_SYNC)) {  //Skip anything between frames, until the start of the next
+            continue;
+        }
+        uart_frame[uart_pos++] = b;
+        if ((uart_pos == 3) && (b > UART_MAX_DATA)) {
+            uart_pos = 0;
+            counters[COUNT_ERRORS]++;
+        } else if ((uart_pos > 3) && (uart_pos == uart_frame[2] + 5)) {
+            UartCommand();
+            uart_pos = 0;
+        }
+    }
 }
 
-void SetAlarm1(void) {
-    switch(Switches()) {
-        case(0x81):
-            SecsFlash();
-            while(Switches() == 0x81) {
-                SetSecs(&Alarm1Time);
-                Num2Disp(&Alarm1Time.secs);
+void UartCommand(void) {
+    unsigned char *d = &uart_frame[3];      //Data of the command
+    unsigned char *r = &uart_reply[4];      //Data of the reply, after its status
+    unsigned char len = uart_frame[2];
+    unsigned char status = STATUS_OK, n = 0, i;
+    unsigned int crc = 0xFFFF, overruns;
+    unsigned long e;
+    ALARM *a;
+    for (i = 1; i < len + 3; i++) {
+        crc = Crc16(crc, uart_frame[i]);
+    }
+    if ((uart_frame[len + 3] != (crc & 0xFF)) || (uart_frame[len + 4] != (crc >> 8))) {
+        counters[COUNT_ERRORS]++;           //Corrupted, so don't act on it or reply. The host will try again
+        return;
+    }
+    counters[COUNT_FRAMES]++;
+    idle_secs = 0;                          //A command is input, so it keeps the clock out of standby
+    switch (uart_frame[1]) {
+        case(CMD_GET_TIME):                 //Reply: epoch_secs (4), rtc_trim (2)
+            if (len != 0) {
+                status = STATUS_BAD_LEN;
+                break;
             }
+            PutLong(r, GetEpoch());
+            r[4] = rtc_trim & 0xFF;
+            r[5] = rtc_trim >> 8;
+            n = 6;
             break;
-        case(0x82):
-            MinsFlash();
-            while(Switches() == 0x82) {
-                SetMins(&Alarm1Time);
-                Num2Disp(&Alarm1Time.mins);
+        case(CMD_SET_TIME):                 //Command: seconds since 00:00:00 01/01/EPOCH_YEAR (4). The second is started afresh
+            if (len != 4) {
+                status = STATUS_BAD_LEN;
+                break;
+            }
+            e = GetLong(d);
+            if (e >= (YEAR_START(100) * SECS_PER_DAY)) {
+                status = STATUS_BAD_VALUE;
+            } else if (menu_state != MENU_OFF) {
+                status = STATUS_BUSY;
+            } else {
+                SetEpoch(e, 0);
+                ScheduleAlarms(e);
+                disp_dirty |= DIRTY_TIME;
+                SaveLater();
             }
             break;
-        case(0x84):
-            HrsFlash();
-            while(Switches() == 0x84) {
-                SetHrs(&Alarm1Time);
-                Num2Disp(&Alarm1Time.hrs);
+        case(CMD_GET_ALARM):                //Command: alarm no. (1). Reply: alarm no., hrs, mins, secs, day, month, year (0-99), flags, repeat (9)
+            if (len != 1) {
+                status = STATUS_BAD_LEN;
+                break;
+            }
+            if (d[0] >= MAX_ALARMS) {
+                status = STATUS_BAD_VALUE;
+                break;
             }
+            a = &alarms[d[0]];
+            r[0] = d[0];
+            r[1] = a->time.hrs;
+            r[2] = a->time.mins;
+            r[3] = a->time.secs;
+            r[4] = a->date.day;
+            r[5] = a->date.month;
+            r[6] = a->date.year_short;
+            r[7] = a->flags;
+            r[8] = a->repeat;
+            n = 9;
             break;
-        case(0x80):
-            disp_LEDS = 0x80;
-            while(Switches() == 0x80) {
-                disp_U2 = DispChars.A;
-                disp_U1 = DispNums[1];
-                Delay10KTCYx(ALARM_TOGGLE);
-                if(PB2pressed() == 1) {
-                    Alarm1On = 1;
-                }
-                if(PB1pressed() == 1) {
-                    Alarm1On = 0;
-                }
-                if(Alarm1On == 1) {
-                    disp_U2 = DispChars.o;
-                    disp_U1 = DispChars.n;
-                }
-                else {
-                    disp_U2 = DispChars.o;
-                    disp_U1 = DispChars.F;
-                }
-                Delay10KTCYx(ALARM_TOGGLE);
+        case(CMD_SET_ALARM):                //Command: as the reply to CMD_GET_ALARM
+            if (len != 9) {
+                status = STATUS_BAD_LEN;
+                break;
+            }
+            if ((d[0] >= MAX_ALARMS) || (d[1] > 23) || (d[2] > 59) || (d[3] > 59) || (d[5] < 1) || (d[5] > 12) || (d[6] > 99) ||
+                (d[4] < 1) || (d[4] > ((((d[6] & 0x03) == 0) ? DaysInMonthLeap : DaysInMonth)[d[5]])) ||
+                ((d[7] & ALARM_MELODY) >= MELODY_COUNT) || ((d[7] & ~(ALARM_ON | ALARM_DATED | ALARM_MELODY)) != 0) || (d[8] > REPEAT_DAILY)) {
+                status = STATUS_BAD_VALUE;
+            } else if (menu_state != MENU_OFF) {
+                status = STATUS_BUSY;
+            } else {
+                a = &alarms[d[0]];
+                a->time.hrs = d[1];
+                a->time.mins = d[2];
+                a->time.secs = d[3];
+                a->date.day = d[4];
+                a->date.month = d[5];
+                a->date.year_short = d[6];
+                a->date.year_long = EPOCH_YEAR + d[6];
+                a->flags = d[7];
+                a->repeat = d[8];
+                ScheduleAlarms(GetEpoch());
+                SaveLater();
             }
             break;
-        default :
-            disp_U2 = DispChars.E;
-            disp_U1 = DispChars.r;
-            disp_LEDS = 0x04;
+        case(CMD_GET_COUNTERS):             //Reply: each of counters[] (2 each, COUNT_ order)
+            if (len != 0) {
+                status = STATUS_BAD_LEN;
+                break;
+            }
+            do {
+                overruns = uart_overruns;   //Re-read if the UART ISR changed it part way through reading it
+            } while (overruns != uart_overruns);
+            counters[COUNT_OVERRUNS] = overruns;
+            for (i = 0; i < COUNTERS; i++) {
+                r[2 * i] = counters[i] & 0xFF;
+                r[(2 * i) + 1] = counters[i] >> 8;
+            }
+            n = 2 * COUNTERS;
+            break;
+        case(CMD_GET_GPS):                  //Reply: flags (bit 0 fix, bit 1 locked), offset at the last PPS used (ticks, 2), frequency estimate (1/32 ppm, 2)
+            if (len != 0) {
+                status = STATUS_BAD_LEN;
+                break;
+            }
+            r[0] = gps_fix | (gps_locked << 1);
+            r[1] = gps_offset & 0xFF;
+            r[2] = gps_offset >> 8;
+            r[3] = gps_freq & 0xFF;
+            r[4] = (gps_freq >> 8) & 0xFF;
+            n = 5;
+            break;
+        default:
+            status = STATUS_BAD_CMD;
             break;
     }
+    uart_reply[0] = UART_SYNC;
+    uart_reply[1] = uart_frame[1] | UART_REPLY;
+    uart_reply[2] = n + 1;
+    uart_reply[3] = status;
+    crc = 0xFFFF;
+    for (i = 1; i < n + 4; i++) {
+        crc = Crc16(crc, uart_reply[i]);
+    }
+    uart_reply[n + 4] = crc & 0xFF;
+    uart_reply[n + 5] = crc >> 8;
+    if (UartSend(uart_reply, n + 6) == 0) {
+        counters[COUNT_DROPPED]++;          //The host will time out & try again
+    }
 }
 
-void SoundAlarm1(void) {
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[1];
-    disp_LEDS = 0xFF;
-    while (!PB2pressed() && !PB1pressed()) {
-        ms_count3 = 0;
-        
-        /*
-        //Wake Me Up Before You Go Go (Chorus)
-        GEN_NOTE(QUAVER, G5, QUAVER);
-        GEN_NOTE(CROTCHET, B5, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_PAUSE(MINIM);
-        //--
-        GEN_NOTE(QUAVER, G5, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, B5, QUAVER);
-        GEN_NOTE(QUAVER, C6, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, G5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, E5, SEMIQUAVER);
-        //--
-        GEN_PAUSE(CROTCHET);
-        GEN_NOTE(QUAVER, E5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, F5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, G5, SEMIQUAVER);
-        GEN_PAUSE(QUAVER);
-        //--
-        GEN_NOTE(QUAVER, A5, QUAVER);
-        GEN_NOTE(QUAVER, A5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, G5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, F5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(QUAVER, B5, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, A5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, F5, QUAVER);
-        */
-        
-        //Jingle Bells
-        GEN_NOTE(CROTCHET, C5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, F5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, C5, CROTCHET);
-        GEN_NOTE(QUAVER, C5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, C5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, C5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, F5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, D5, QUAVER);
-        GEN_PAUSE(MINIM);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, E5, QUAVER);
-        GEN_PAUSE(MINIM);
-        //--
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, A5, QUAVER);
-        GEN_PAUSE(MINIM);
-        //--
-        GEN_NOTE(CROTCHET, C5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, F5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, C5, QUAVER);
-        GEN_PAUSE(MINIM);
-        //-
-        GEN_NOTE(CROTCHET, C5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, F5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, D5, QUAVER);
-        GEN_PAUSE(MINIM);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(QUAVER, C6, SEMIQUAVER);
-        GEN_NOTE(QUAVER, C6, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D6, QUAVER);
-        GEN_NOTE(CROTCHET, C6, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, F5, CROTCHET);
-        GEN_NOTE(MINIM, C6, QUAVER);
-        //--Chorus        
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(MINIM, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(MINIM, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, C6, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, F5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        //--
-        GEN_NOTE(SEMIBREVE, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        GEN_NOTE(CROTCHET, AS5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(QUAVER, A5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        //--
-        GEN_NOTE(MINIM, G5, QUAVER);
-        GEN_NOTE(MINIM, C6, QUAVER);
-        Delay10KTCYx(ALARM_REPEAT_DELAY);
-    }
-    Alarm1On = 0;
-}
-
-void Alarm2Flash(void) {
-    disp_LEDS &= 0xC0;
-    disp_LEDS |= ALARM2;
-    dp_mask |= (1 << 2);
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[2];
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[2];
-    Delay10KTCYx(SET_MENU_FLASH);
-    disp_U2 = 0xFF;
-    disp_U1 = 0xFF;
-    Delay10KTCYx(SET_MENU_FLASH); 
+char UartSend(unsigned char *buf, char n) {
+    char i;
+    if ((unsigned char)((tx_tail - tx_head - 1) & (UART_TX_SIZE - 1)) < n) {   //Never wait for room, as that would block the main loop
+        return(0);
+    }
+    for (i = 0; i < n; i++) {
+        tx_buf[tx_head] = buf[i];
+        tx_head = (tx_head + 1) & (UART_TX_SIZE - 1);
+    }
+    PIE1bits.TX1IE = 1;                     //The UART ISR sends them, and turns itself off once they have all gone
+    return(1);
 }
 
-void SetAlarm2(void) {
-    switch(Switches()) {
-        case(0x41):
-            SecsFlash();
-            while(Switches() == 0x41) {
-                SetSecs(&Alarm2Time);
-                Num2Disp(&Alarm2Time.secs);
+void PutLong(unsigned char *p, unsigned long v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+unsigned long GetLong(unsigned char *p) {
+    return(p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24));
+}
+
+void StartGps(void) {
+    SPBRGH2 = UART_BRG >> 8;        //9600 baud, the same as EUSART1. RG1/RG2 are inputs from reset, as the EUSART needs
+    SPBRG2 = UART_BRG & 0xFF;
+    BAUDCON2 = 0x08;
+    TXSTA2 = 0x04;                  //Receive only: nothing is sent to the receiver
+    RCSTA2 = 0x90;
+    IPR3bits.RC2IP = 0;             //Set as a low-priority interrupt
+    PIE3bits.RC2IE = 1;
+    INTCON2bits.INTEDG1 = 1;        //The PPS starts the second with a rising edge
+    INTCON3bits.INT1IP = 1;         //High priority, so where Timer1 is at the PPS is read within a few instructions of it
+    INTCON3bits.INT1IF = 0;
+    INTCON3bits.INT1IE = 1;
+}
+
+void Pps_isr(void) {
+    unsigned char h, l, ovf;
+    do {
+        ovf = PIR1bits.TMR1IF;      //A second which has ended but not yet been counted (Timer1 ISR runs after this one) is counted here
+        do {
+            h = TMR1H;              //8-bit reads, so re-read if TMR1L carried into TMR1H in between
+            l = TMR1L;
+        } while (h != TMR1H);
+    } while (ovf != PIR1bits.TMR1IF);
+    pps_epoch = epoch_secs;
+    pps_left = (0 - (((unsigned int)h << 8) | l)) & 0xFFFF;  //Timer1 is 16 bits, which an int may be wider than (the host build)
+    pps_acc = trim_acc;
+    if (ovf == 1) {
+        pps_epoch++;
+        pps_ticks = ((unsigned int)h << 8) | l;     //Counted from 0 since the overflow, as TMR1H hasn't been added to yet
+        pps_acc += 2 * rtc_trim;    //and nor has this second's trim
+    } else {
+        pps_ticks = ((((unsigned int)h << 8) | l) - ((unsigned int)tmr1_start << 8)) & 0xFFFF;
+        if (pps_ticks < GPS_HALF_TICKS) {   //Measured from the start of a second which is being shortened/lengthened, so that is still to come
+            if (tmr1_start > TIMER1_HIGH) {
+                pps_acc += TRIM_STEP;
+            } else if (tmr1_start < TIMER1_HIGH) {
+                pps_acc -= TRIM_STEP;
             }
-            break;
-        case(0x42):
-            MinsFlash();
-            while(Switches() == 0x42) {
-                SetMins(&Alarm2Time);
-                Num2Disp(&Alarm2Time.mins);
+        }
+    }
+    pps_ms = ms_ticks;              //Only written by the low-priority ISR, which can't run during this one
+    pps_count++;                    //Last, so GpsSync() can tell if it copied the values while they were being written
+}
+
+void Gps_rx_isr(void) {
+    unsigned char next;
+    if (RCSTA2bits.OERR == 1) {
+        RCSTA2bits.CREN = 0;
+        RCSTA2bits.CREN = 1;
+        uart_overruns++;
+    }
+    next = (gps_head + 1) & (GPS_RX_SIZE - 1);
+    if (next != gps_tail) {
+        gps_buf[gps_head] = RCREG2;
+        gps_head = next;
+    } else {
+        next = RCREG2;
+        uart_overruns++;
+    }
+}
+
+void GpsTask(void) {
+    while (gps_tail != gps_head) {
+        NmeaChar(gps_buf[gps_tail]);
+        gps_tail = (gps_tail + 1) & (GPS_RX_SIZE - 1);
+    }
+    if (gps_stepped == 1) {
+        gps_stepped = 0;
+        ScheduleAlarms(GetEpoch());         //The alarms are due from the new time, and ones stepped over don't sound
+        disp_dirty |= DIRTY_TIME;
+        SaveLater();
+        counters[COUNT_STEPS]++;
+    }
+}
+
+void NmeaChar(char c) {
+    char hex;
+    if (c == '$') {                         //Always starts a sentence afresh, even part way through one which has been cut short
+        nmea_state = NMEA_BODY;
+        nmea_type = NMEA_OTHER;
+        nmea_field = 0;
+        nmea_len = 0;
+        nmea_sum = 0;
+        nmea_have = 0;
+        return;
+    }
+    switch (nmea_state) {
+        case(NMEA_BODY):
+            if (c == '*') {
+                NmeaField();
+                nmea_state = NMEA_SUM_HIGH;
+            } else if ((c < ' ') || (c > '~')) {    //Line ended before the checksum, or noise
+                nmea_state = NMEA_IDLE;
+            } else {
+                nmea_sum ^= c;
+                if (c == ',') {
+                    NmeaField();
+                    nmea_field++;
+                    nmea_len = 0;
+                } else if (nmea_len < NMEA_FIELD_MAX) {
+                    nmea_buf[nmea_len++] = c;
+                }
             }
             break;
-        case(0x44):
-            HrsFlash();
-            while(Switches() == 0x44) {
-                SetHrs(&Alarm2Time);
-                Num2Disp(&Alarm2Time.hrs);
+        case(NMEA_SUM_HIGH):
+        case(NMEA_SUM_LOW):
+            if ((c >= '0') && (c <= '9')) {
+                hex = c - '0';
+            } else if ((c >= 'A') && (c <= 'F')) {
+                hex = c - 'A' + 10;
+            } else {
+                nmea_state = NMEA_IDLE;
+                break;
             }
-            break;
-        case(0x48):
-            YearFlash();
-            while(Switches() == 0x48) {
-                SetYear(&Alarm2Date);
-                Num2Disp(&Alarm2Date.year_short);
+            if (nmea_state == NMEA_SUM_HIGH) {
+                nmea_check = hex << 4;
+                nmea_state = NMEA_SUM_LOW;
+                break;
             }
-            break;
-        case(0x50):
-            MonthFlash();
-            while(Switches() == 0x50) {
-                SetMonth(&Alarm2Date);
-                Num2Disp(&Alarm2Date.month);
+            nmea_state = NMEA_IDLE;
+            if ((nmea_check | hex) != nmea_sum) {
+                break;
             }
-            break;
-        case(0x60):
-            DayFlash();
-            while(Switches() == 0x60) {
-                SetDay(&Alarm2Date);
-                Num2Disp(&Alarm2Date.day);
+            if (nmea_type == NMEA_RMC) {
+                gps_fix = ((nmea_have & HAVE_FIX) != 0);
+            }
+            if ((gps_fix == 1) && ((nmea_have & (HAVE_TIME | HAVE_DATE)) == (HAVE_TIME | HAVE_DATE))) {
+                GpsSync(DateToEpoch(&nmea_date, &nmea_time) + GPS_UTC_OFFSET);
             }
             break;
-        case(0x40):
-            disp_LEDS = 0x40;
-            while(Switches() == 0x40) {
-                disp_U2 = DispChars.A;
-                disp_U1 = DispNums[2];
-                Delay10KTCYx(ALARM_TOGGLE);
-                if(PB2pressed() == 1) {
-                    Alarm2On = 1;
-                }
-                if(PB1pressed() == 1) {
-                    Alarm2On = 0;
+        default:
+            break;
+    }
+}
+
+void NmeaField(void) {
+    char i;
+    if (nmea_field == 0) {                  //Address: talker (GP, GN...) then the sentence type
+        if ((nmea_len == 5) && (nmea_buf[2] == 'R') && (nmea_buf[3] == 'M') && (nmea_buf[4] == 'C')) {
+            nmea_type = NMEA_RMC;
+        } else if ((nmea_len == 5) && (nmea_buf[2] == 'Z') && (nmea_buf[3] == 'D') && (nmea_buf[4] == 'A')) {
+            nmea_type = NMEA_ZDA;
+        }
+        return;
+    }
+    if (nmea_type == NMEA_OTHER) {
+        return;
+    }
+    if (nmea_field == 1) {                  //Time, hhmmss with any fraction. The PPS starts the second, so one which isn't whole isn't used
+        nmea_time.hrs = NmeaDigits(2, 0);
+        nmea_time.mins = NmeaDigits(2, 2);
+        nmea_time.secs = NmeaDigits(2, 4);
+        for (i = 7; i < nmea_len; i++) {
+            if (nmea_buf[i] != '0') {
+                return;
+            }
+        }
+        if ((nmea_len >= 6) && (nmea_time.hrs < 24) && (nmea_time.mins < 60) && (nmea_time.secs < 60)) {    //Leap second (60) isn't used
+            nmea_have |= HAVE_TIME;
+        }
+    } else if (nmea_type == NMEA_RMC) {
+        if ((nmea_field == 2) && (nmea_len == 1) && (nmea_buf[0] == 'A')) {
+            nmea_have |= HAVE_FIX;
+        } else if ((nmea_field == 9) && (nmea_len == 6)) {  //Date, ddmmyy
+            nmea_date.day = NmeaDigits(2, 0);
+            nmea_date.month = NmeaDigits(2, 2);
+            nmea_date.year_short = NmeaDigits(2, 4);
+            nmea_have |= HAVE_DATE;
+        }
+    } else if (nmea_field == 2) {           //ZDA day, month & year (yyyy), each in its own field
+        nmea_date.day = NmeaDigits(2, 0);
+    } else if (nmea_field == 3) {
+        nmea_date.month = NmeaDigits(2, 0);
+    } else if ((nmea_field == 4) && (nmea_len == 4) && (NmeaDigits(2, 0) == 20)) {
+        nmea_date.year_short = NmeaDigits(2, 2);
+        nmea_have |= HAVE_DATE;
+    }
+    if ((nmea_have & HAVE_DATE) && ((nmea_date.month < 1) || (nmea_date.month > 12) || (nmea_date.year_short > 99) || (nmea_date.day < 1) ||
+        (nmea_date.day > (((nmea_date.year_short & 0x03) == 0) ? DaysInMonthLeap : DaysInMonth)[nmea_date.month]))) {
+        nmea_have &= ~HAVE_DATE;
+    }
+}
+
+char NmeaDigits(char n, char at) {
+    char v = 0;
+    if (at + n > nmea_len) {
+        return(0xFF);
+    }
+    for (; n > 0; n--, at++) {
+        if ((nmea_buf[at] < '0') || (nmea_buf[at] > '9')) {
+            return(0xFF);
+        }
+        v = (v * 10) + (nmea_buf[at] - '0');
+    }
+    return(v);
+}
+
+void GpsSync(unsigned long e) {
+    unsigned long clock;
+    unsigned int ticks, left, ms;
+    unsigned char count;
+    signed int acc, trim;
+    signed long x;
+    unsigned long pps;
+    char ie;
+    do {
+        count = pps_count;                  //Copy the last PPS, again if Pps_isr() wrote it part way through
+        clock = pps_epoch;
+        ticks = pps_ticks;
+        left = pps_left;
+        acc = pps_acc;
+        ms = pps_ms;
+    } while (count != pps_count);
+    if ((count == gps_used) || ((unsigned int)(GetTicks() - ms) >= GPS_PAIR_MS) || (menu_state != MENU_OFF)) {
+        return;                             //Already used, no PPS before it to pair it with, or the time is being set by hand
+    }
+    gps_used = count;
+    gps_last = e;
+    counters[COUNT_GPS]++;
+    pps = clock;
+    if (ticks < GPS_HALF_TICKS) {           //The second started ticks before the PPS, so the RTC is ahead
+        x = ticks;
+    } else {                                //or the next starts after it, so it is behind, by the ticks until Timer1 overflows
+        x = -(signed long)left;
+        clock++;
+    }
+    x += ((signed long)acc * 256) / TRIM_STEP;     //The trim owed is a correction to the RTC which will be made as it adds up
+    gps_offset = x;
+    if ((gps_locked == 0) || (clock != e) || (x > GPS_STEP_TICKS) || (x < -GPS_STEP_TICKS)) {
+        GpsStep(e, pps, ticks, left);
+        gps_stepped = 1;
+        if (gps_locked == 0) {
+            gps_freq = (signed long)rtc_trim * GPS_FREQ_SCALE;  //Start from the trim the board has, measured or saved
+            gps_locked = 1;
+        }
+        return;
+    }
+    gps_freq -= x;                          //Integral: the trim the crystal needs for the offset to stay at 0
+    if (gps_freq > (signed long)GPS_TRIM_MAX * GPS_FREQ_SCALE) {
+        gps_freq = (signed long)GPS_TRIM_MAX * GPS_FREQ_SCALE;
+    } else if (gps_freq < -(signed long)GPS_TRIM_MAX * GPS_FREQ_SCALE) {
+        gps_freq = -(signed long)GPS_TRIM_MAX * GPS_FREQ_SCALE;
+    }
+    x = (gps_freq / GPS_FREQ_SCALE) - (GPS_KP * x);     //plus proportional: slow down while ahead, speed up while behind
+    trim = (x > GPS_TRIM_MAX) ? GPS_TRIM_MAX : ((x < -GPS_TRIM_MAX) ? -GPS_TRIM_MAX : x);
+    ie = PIE1bits.TMR1IE;
+    PIE1bits.TMR1IE = 0;                    //Timer1 ISR mustn't read rtc_trim part written
+    rtc_trim = trim;
+    PIE1bits.TMR1IE = ie;
+}
+
+void GpsStep(unsigned long e, unsigned long clock, unsigned int ticks, unsigned int left) {
+    unsigned long now;
+    unsigned int t;
+    unsigned char h, l, ovf;
+    char ie = PIE1bits.TMR1IE;
+    char pps = INTCON3bits.INT1IE;
+    PIE1bits.TMR1IE = 0;                    //Neither ISR may change what is read here before the new time is written
+    INTCON3bits.INT1IE = 0;
+    do {
+        ovf = PIR1bits.TMR1IF;              //Read as Pps_isr() does, so the ticks are counted the same way
+        do {
+            h = TMR1H;
+            l = TMR1L;
+        } while (h != TMR1H);
+    } while (ovf != PIR1bits.TMR1IF);
+    now = epoch_secs;
+    t = ((unsigned int)h << 8) | l;
+    if (ovf == 1) {                         //A second which has ended but not yet been counted
+        now++;
+    } else {
+        t = (t - ((unsigned int)tmr1_start << 8)) & 0xFFFF;
+    }
+    if (now == clock) {                     //Ticks since the PPS. It was at most GPS_PAIR_MS ago, so Timer1 has overflowed once at most since
+        t = (t - ticks) & 0xFFFF;
+    } else {
+        t = (t + left) & 0xFFFF;
+    }
+    SetEpoch(e + (t >> 15), t & 0x7FFF);
+    trim_acc = 0;                           //The trim owed to the old time goes with it
+    INTCON3bits.INT1IE = pps;
+    PIE1bits.TMR1IE = ie;
+}
+
+void RadioSample(void) {
+    unsigned char next;
+    if ((PORTBbits.RB2 == RADIO_ACTIVE) == radio_level) {
+        radio_count = 0;                    //Any glitch back to the filtered state restarts the count, as DebounceButtons()
+        return;
+    }
+    if (++radio_count < RADIO_FILTER_MS) {
+        return;
+    }
+    radio_count = 0;
+    radio_level ^= 1;
+    if (radio_level == 1) {
+        radio_rise = ms_ticks - RADIO_FILTER_MS;    //The pulse started when RB2 first changed
+    } else {
+        next = (radio_head + 1) & (RADIO_PULSES - 1);
+        if (next != radio_tail) {           //Dropped if RadioTask() has fallen behind, which only a burst of noise can make it
+            radio_starts[radio_head] = radio_rise;
+            radio_widths[radio_head] = (ms_ticks - RADIO_FILTER_MS) - radio_rise;
+            radio_head = next;
+        }
+    }
+}
+
+void RadioTask(void) {
+    while (radio_tail != radio_head) {
+        RadioPulse(radio_starts[radio_tail], radio_widths[radio_tail]);
+        radio_tail = (radio_tail + 1) & (RADIO_PULSES - 1);
+    }
+    if ((radio_sec != RADIO_NO_SYNC) && ((unsigned int)(GetTicks() - radio_second) > RADIO_LOST_MS)) {
+        radio_sec = RADIO_NO_SYNC;          //The signal has been lost (or the clock was in standby), so wait for the next minute mark
+        radio_last = 0;
+    }
+}
+
+void RadioPulse(unsigned int start, unsigned int width) {
+    unsigned int gap = start - radio_second;
+    char w = RadioWidth(width);
+    char n, i;
+    if ((radio_sec != RADIO_NO_SYNC) && (w == RADIO_SHORT) && (gap >= 150) && (gap <= 250)) {
+        radio_b[radio_sec >> 3] |= (1 << (radio_sec & 0x07));  //MSF B=1 (A=0), the second pulse of the second
+        return;
+    }
+    if ((gap >= 1000 - RADIO_JITTER_MS) && (gap <= 1000 + RADIO_JITTER_MS)) {
+        n = 1;
+    } else if ((gap >= 2000 - RADIO_JITTER_MS) && (gap <= 2000 + RADIO_JITTER_MS)) {
+        n = 2;
+    } else {
+        if ((radio_sec == RADIO_NO_SYNC) && (w != RADIO_NOISE)) {
+            radio_second = start;           //Not in step with the seconds yet, so take it as the start of one
+        }
+        return;                             //otherwise it is noise between them
+    }
+    radio_second = start;
+    if ((w == RADIO_MARK) || (n == 2)) {    //A minute mark: a 500ms pulse (MSF) or a pulse 2s after the last (DCF77 has none in second 59)
+        if ((radio_sec != RADIO_NO_SYNC) && (radio_bad == 0) && (((radio_msf == 1) && (w == RADIO_MARK) && (n == 1) && (radio_sec == 59)) ||
+            ((radio_msf == 0) && (n == 2) && ((radio_sec == 58) || ((radio_sec == 59) && (RadioBit(radio_a, 19) == 1)))))) {
+            RadioFrame(start);              //The frame just ended is whole (a DCF77 leap second, announced by bit 19, is a 0 in second 59)
+        }
+        radio_msf = (w == RADIO_MARK);
+        radio_sec = 0;
+        radio_bad = 0;
+        for (i = 0; i < 8; i++) {
+            radio_a[i] = 0;
+            radio_b[i] = 0;
+        }
+        if (radio_msf == 1) {
+            return;
+        }
+    } else if (radio_sec == RADIO_NO_SYNC) {
+        return;
+    } else if (++radio_sec > 59) {          //Missed the minute mark
+        radio_sec = RADIO_NO_SYNC;
+        return;
+    }
+    if ((w == RADIO_NOISE) || (w == RADIO_MARK) || ((w == RADIO_LONGER) && (radio_msf == 0))) {
+        radio_bad = 1;
+    } else if (w != RADIO_SHORT) {
+        radio_a[radio_sec >> 3] |= (1 << (radio_sec & 0x07));
+        if (w == RADIO_LONGER) {
+            radio_b[radio_sec >> 3] |= (1 << (radio_sec & 0x07));
+        }
+    }
+}
+
+char RadioWidth(unsigned int width) {
+    if ((width >= 50) && (width < 150)) {
+        return(RADIO_SHORT);
+    } else if ((width >= 150) && (width < 250)) {
+        return(RADIO_LONG);
+    } else if ((width >= 250) && (width < 350)) {
+        return(RADIO_LONGER);
+    } else if ((width >= 400) && (width < 600)) {
+        return(RADIO_MARK);
+    } else {
+        return(RADIO_NOISE);
+    }
+}
+
+void RadioFrame(unsigned int mark) {
+    TIME t;
+    DATE d;
+    char wday, ok;
+    unsigned int ms;
+    unsigned long e, was;
+    if (radio_msf == 0) {                   //DCF77: bit 0 is 0 & bit 20 is 1, the fields are least significant bit first, with even parity
+        ok = (RadioBit(radio_a, 0) == 0) && (RadioBit(radio_a, 20) == 1) && (RadioParity(radio_a, 21, 28) == 0) &&
+             (RadioParity(radio_a, 29, 35) == 0) && (RadioParity(radio_a, 36, 58) == 0);
+        t.mins = RadioBcd(21, 7, 1);
+        t.hrs = RadioBcd(29, 6, 1);
+        d.day = RadioBcd(36, 6, 1);
+        wday = RadioBcd(42, 3, 1);          //1 = Monday to 7 = Sunday
+        if (wday == 7) {
+            wday = 0;
+        } else if (wday == 0) {
+            wday = 0xFF;
+        }
+        d.month = RadioBcd(45, 5, 1);
+        d.year_short = RadioBcd(50, 8, 1);
+    } else {                                //MSF: A bits 52-59 are 01111110, the fields are most significant bit first, with odd parity in B 54-57
+        ok = ((radio_a[6] & 0xF0) == 0xE0) && (radio_a[7] == 0x07) && ((RadioParity(radio_a, 17, 24) ^ RadioBit(radio_b, 54)) == 1) &&
+             ((RadioParity(radio_a, 25, 35) ^ RadioBit(radio_b, 55)) == 1) && ((RadioParity(radio_a, 36, 38) ^ RadioBit(radio_b, 56)) == 1) &&
+             ((RadioParity(radio_a, 39, 51) ^ RadioBit(radio_b, 57)) == 1);
+        d.year_short = RadioBcd(24, 8, -1);
+        d.month = RadioBcd(29, 5, -1);
+        d.day = RadioBcd(35, 6, -1);
+        wday = RadioBcd(38, 3, -1);         //0 = Sunday
+        t.hrs = RadioBcd(44, 6, -1);
+        t.mins = RadioBcd(51, 7, -1);
+    }
+    t.secs = 0;
+    if ((ok == 0) || (t.mins > 59) || (t.hrs > 23) || (d.year_short > 99) || (d.month < 1) || (d.month > 12) || (d.day < 1) ||
+        (d.day > (((d.year_short & 0x03) == 0) ? DaysInMonthLeap : DaysInMonth)[d.month]) || (Weekday(DaysFromCivil(&d)) != wday)) {
+        radio_last = 0;
+        return;
+    }
+    e = DateToEpoch(&d, &t);
+    if (e != radio_last + 60) {             //One frame can pass its checks by chance, so wait for the next to agree with it
+        radio_last = e;
+        return;
+    }
+    radio_last = e;
+    if (((gps_locked == 1) && ((GetEpoch() - gps_last) < RADIO_GPS_SECS)) || (menu_state != MENU_OFF)) {
+        return;                             //The GPS is in use, or the time is being set by hand
+    }
+    counters[COUNT_RADIO]++;
+    was = GetEpoch();
+    ms = GetTicks() - mark;                 //Time since the minute started (a few hundred ms)
+    e += ms / 1000;
+    SetEpoch(e, (((unsigned long)(ms % 1000)) << 15) / 1000);
+    if (e != was) {                         //Only if the time has changed by a second or more, so that the EEPROM isn't written every minute
+        ScheduleAlarms(e);
+        disp_dirty |= DIRTY_TIME;
+        SaveLater();
+    }
+}
+
+char RadioBit(unsigned char *bits, char n) {
+    return((bits[n >> 3] >> (n & 0x07)) & 0x01);
+}
+
+char RadioParity(unsigned char *bits, char first, char last) {
+    char p = 0;
+    for (; first <= last; first++) {
+        p ^= RadioBit(bits, first);
+    }
+    return(p);
+}
+
+char RadioBcd(char first, char n, signed char step) {
+    const char weights[] = { 1, 2, 4, 8, 10, 20, 40, 80 };
+    char i, units = 0, tens = 0;
+    for (i = 0; i < n; i++, first += step) {
+        if (RadioBit(radio_a, first) == 1) {
+            if (i < 4) {
+                units += weights[i];
+            } else {
+                tens += weights[i];
+            }
+        }
+    }
+    if (units > 9) {
+        return(0xFF);
+    }
+    return(tens + units);
+}
+
+char Switches(void) {           
+    char temp, temp1, temp2; 
+    temp1 = PORTC;              //Using bit shifting & masking operations, returns the value of the toggle switches
+    temp1 >>= 2;
+    temp1 &= 0x0F;
+    temp2 = PORTH;
+    temp2 &= 0xF0;
+    temp = (temp1 | temp2);
+    return(temp);
+}
+
+void MenuTask(void) {
+    char sw = Switches();
+    unsigned int now = GetTicks();
+    unsigned long e;
+    if (sw != menu_sw) {                        //The switches have changed, so leave the current set mode & enter the one they now choose
+        MenuLeave();
+        MenuEnter(sw);
+        return;
+    }
+    if ((menu_t == &menu_time) && ((e = GetEpoch()) != menu_epoch)) {  //Count the shadow of the RTC on with it, so the time being set keeps running
+        EpochToDate(DateToEpoch(&menu_date, &menu_time) + (e - menu_epoch), &menu_date, &menu_time);
+        menu_epoch = e;
+        if (menu_state == MENU_EDIT) {
+            MenuShow();
+        }
+    }
+    switch (menu_state) {
+        case(MENU_FLASH):                       //Flash the name of the field (or the alarm no.) MENU_FLASHES times, then show its value
+            if ((unsigned int)(now - menu_last) >= SET_MENU_FLASH) {
+                menu_last = now;
+                menu_phase++;
+                if (menu_phase >= MENU_FLASHES) {
+                    menu_state = (menu_field != 0) ? MENU_EDIT : MENU_ALARM_ON;
+                    menu_phase = 0;
+                    pb1_edge = 0;               //Discard any presses made while the name was flashing
+                    pb2_edge = 0;
+                    MenuShow();
+                } else if ((menu_phase & 0x01) != 0) {
+                    disp_U2 = 0xFF;
+                    disp_U1 = 0xFF & dp_mask;
+                } else if (menu_field != 0) {
+                    FieldName(menu_field);
+                } else {
+                    AlarmNumDisp(alarm_sel);
                 }
-                if(Alarm2On == 1) {
-                    disp_U2 = DispChars.o;
-                    disp_U1 = DispChars.n;
+            }
+            break;
+        case(MENU_EDIT):                        //Step the field forwards while PB2 is held, backwards while PB1 is, every KEY_REPEAT_DELAY ms
+            if (PB2pressed() || PB1pressed()) {
+                if ((unsigned int)(now - menu_last) >= KEY_REPEAT_DELAY) {
+                    menu_last = now;
+                    StepField(menu_field, menu_t, menu_d, PB2pressed() ? 1 : -1);
+                    menu_edited = 1;
+                    MenuShow();
                 }
-                else {
-                    disp_U2 = DispChars.o;
-                    disp_U1 = DispChars.F;
+            } else {
+                menu_last = now - KEY_REPEAT_DELAY;     //so that the next press steps it straight away
+            }
+            break;
+        case(MENU_ALARM_ON):                    //Alternate between the alarm no. & its setting every ALARM_TOGGLE ms
+            if (PB2clicked() == 1) {            //PB2 switches it on ('on', goes off once) then toggles whether it repeats every day ('rP')
+                if ((menu_sw & ALARM_SELECT) == ALARM_DATE) {
+                    menu_a->flags |= (ALARM_ON | ALARM_DATED);
+                    menu_a->repeat = 0;
+                } else if (((menu_a->flags & (ALARM_ON | ALARM_DATED)) == ALARM_ON) && (menu_a->repeat == 0)) {
+                    menu_a->repeat = REPEAT_DAILY;      //Already on as a time of day alarm, so make it repeat every day
+                } else {
+                    menu_a->flags = (menu_a->flags & ~ALARM_DATED) | ALARM_ON;
+                    menu_a->repeat = 0;
                 }
-                Delay10KTCYx(ALARM_TOGGLE);
+                menu_phase = 0;                 //Show the new setting straight away
+                menu_last = now - ALARM_TOGGLE;
+            }
+            if (PB1clicked() == 1) {            //PB1 switches it off ('oF')
+                menu_a->flags &= ~ALARM_ON;
+                menu_phase = 0;
+                menu_last = now - ALARM_TOGGLE;
+            }
+            if ((unsigned int)(now - menu_last) >= ALARM_TOGGLE) {
+                menu_last = now;
+                menu_phase++;
+                MenuShow();
             }
             break;
-        default :
-            disp_U2 = DispChars.E;
-            disp_U1 = DispChars.r;
-            disp_LEDS = 0x04;
+        case(MENU_SELECT):                      //PB2 steps forwards through the alarms, PB1 backwards, wrapping around at either end
+            if (PB2clicked() == 1) {
+                alarm_sel = (alarm_sel < (MAX_ALARMS - 1)) ? alarm_sel + 1 : 0;
+                MenuShow();
+            }
+            if (PB1clicked() == 1) {
+                alarm_sel = (alarm_sel > 0) ? alarm_sel - 1 : MAX_ALARMS - 1;
+                MenuShow();
+            }
+            break;
+        default:
             break;
     }
 }
 
-void SoundAlarm2(void) {
-    disp_U2 = DispChars.A;
-    disp_U1 = DispNums[2];
-    disp_LEDS = 0xFF;
-    while (!PB2pressed() && !PB1pressed()) {
-        ms_count3 = 0;
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(MINIM, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(MINIM, D5, CROTCHET);
-        //--
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(QUAVER, FS5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, G5, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(QUAVER, FS5, SEMIQUAVER);
-        GEN_NOTE(QUAVER, G5, SEMIQUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(MINIM, A5, CROTCHET);
-        //--
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, A5, QUAVER);
-        GEN_NOTE(CROTCHET, G5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, FS5, QUAVER);
-        //--
-        GEN_NOTE(CROTCHET, E5, QUAVER);
-        GEN_NOTE(CROTCHET, D5, QUAVER);
-        GEN_NOTE(MINIM, D5, QUAVER);
-        Delay10KTCYx(ALARM_REPEAT_DELAY);
-    }
-    Alarm2On = 0;
-}
-
-char CompareTimes(volatile TIME mainTime, volatile DATE *mainDate, volatile TIME *alarmTime, volatile DATE *alarmDate, char args) {
-    switch (args) {
-        case(1):
-            if ((mainTime.hrs == alarmTime->hrs) && (mainTime.mins == alarmTime->mins) && (mainTime.secs == alarmTime->secs)) {
-                return (1);
+void MenuEnter(char sw) {
+    char mode = sw & ALARM_SELECT;              //ALARM_TIME, ALARM_DATE, ALARM_SELECT, or 0 to set the RTC
+    char n, i;
+    unsigned long due, now;
+    menu_sw = sw;
+    menu_field = sw & ~ALARM_SELECT;
+    menu_phase = 0;
+    menu_last = GetTicks();
+    menu_edited = 0;
+    menu_t = 0;
+    if (sw == 0x00) {                           //Leaving the menu. Alarms or the time may have been changed, so work out when the alarms are due again
+        menu_state = MENU_OFF;
+        n = alarm_order[0];
+        due = (alarm_due == 1) ? alarm_epoch : NO_ALARM;
+        now = GetEpoch();
+        ScheduleAlarms(now);
+        if ((due <= now) && (AlarmNextFire(n, due) == due)) {
+            for (i = 0; alarm_order[i] != n; i++) {     //The alarm which fell due while in the menu (and is still set for then) is put back at the
+            }                                           //head of the list as due then, so it isn't lost. Only it is: the others are due from now,
+            for (; i > 0; i--) {                        //so ones the time has been moved on past don't all sound in turn
+                alarm_order[i] = alarm_order[i - 1];
+            }
+            alarm_order[0] = n;
+            alarm_fire[n] = due;
+            LoadNextAlarm();
+        }
+        disp_dirty |= DIRTY_SCREEN;             //The menu has written over the date/time
+        idle_secs = 0;                          //Time spent in the menu doesn't count towards standby
+        SaveLater();                            //Save what has been set
+        return;
+    }
+    if (mode == ALARM_SELECT) {
+        menu_state = MENU_SELECT;
+        disp_LEDS = ALARM_SELECT;
+        pb1_edge = 0;                           //Discard any presses made before entering this mode
+        pb2_edge = 0;
+        MenuShow();
+        return;
+    }
+    if (((menu_field & (menu_field - 1)) != 0) || ((mode == 0) && (menu_field == 0)) ||
+        ((mode == ALARM_TIME) && ((menu_field & (DAY | MONTH | YEAR)) != 0))) {
+        menu_state = MENU_ERROR;                //More than one field chosen, or a date for an alarm which goes off at a time of day
+        disp_U2 = DispChars.E;
+        disp_U1 = DispChars.r & dp_mask;
+        disp_LEDS = (mode == 0) ? 0x02 : 0x04;  //Display error code 2 (menu) or 4 (alarm setting) to indicate this to user. Clock remains running in background
+        return;
+    }
+    if (mode == 0) {                            //Setting the RTC, so take a shadow of it to set
+        menu_epoch = GetEpoch();
+        EpochToDate(menu_epoch, &menu_date, &menu_time);
+        menu_t = &menu_time;
+        menu_d = &menu_date;
+    } else {                                    //Setting an alarm, which is set in place
+        menu_a = &alarms[alarm_sel];
+        menu_t = &menu_a->time;
+        menu_d = &menu_a->date;
+    }
+    menu_state = MENU_FLASH;
+    disp_LEDS = sw;
+    if (menu_field != 0) {
+        FieldName(menu_field);
+    } else {
+        AlarmNumDisp(alarm_sel);
+    }
+}
+
+void MenuLeave(void) {
+    if ((menu_t != &menu_time) || (menu_state != MENU_EDIT)) {
+        return;
+    }
+    if ((menu_field == SECS) && (menu_edited == 1)) {   //The seconds have been set, so start the second shown afresh
+        SetEpoch(DateToEpoch(&menu_date, &menu_time) + (GetEpoch() - menu_epoch), 0);
+    } else {
+        ShiftEpoch(DateToEpoch(&menu_date, &menu_time) - menu_epoch);   //Add on the change made to the shadow, keeping the seconds counted since
+    }
+}
+
+void MenuShow(void) {
+    switch (menu_state) {
+        case(MENU_EDIT):
+            Num2Disp(Bin2Bcd(FieldValue(menu_field, menu_t, menu_d)));
+            break;
+        case(MENU_ALARM_ON):
+            if ((menu_phase & 0x01) == 0) {
+                AlarmNumDisp(alarm_sel);
+            } else if ((menu_a->flags & ALARM_ON) == 0) {
+                disp_U2 = DispChars.o;
+                disp_U1 = DispChars.F & dp_mask;
+            } else if (((menu_a->flags & ALARM_DATED) == 0) && (menu_a->repeat != 0)) {
+                disp_U2 = DispChars.r;
+                disp_U1 = DispChars.P & dp_mask;
             } else {
-                return (0);
+                disp_U2 = DispChars.o;
+                disp_U1 = DispChars.n & dp_mask;
             }
             break;
-        case(2) :
-            if((mainTime.hrs == alarmTime->hrs) && (mainTime.mins == alarmTime->mins) && (mainTime.secs == alarmTime->secs) && (mainDate->day == alarmDate->day) && (mainDate->month == alarmDate->month) && (mainDate->year_short == alarmDate->year_short)) {
-                return(1);
+        case(MENU_SELECT):
+            AlarmNumDisp(alarm_sel);
+            break;
+        default:
+            break;
+    }
+}
+
+char PB1pressed(void) {
+    return(pb1_down);
+}
+
+char PB2pressed(void) {
+    return(pb2_down);
+}
+
+char PB1clicked(void) {
+    if(pb1_edge == 1) {
+        pb1_edge = 0;
+        return(1);
+    }
+    else {
+        return(0);
+    }
+}
+
+char PB2clicked(void) {
+    if(pb2_edge == 1) {
+        pb2_edge = 0;
+        return(1);
+    }
+    else {
+        return(0);
+    }
+}
+
+void DebounceButtons(void) {
+    char pb1_raw, pb2_raw;
+    pb1_raw = (PORTJbits.RJ5 == 0);             //Push buttons are active-low
+    pb2_raw = (PORTBbits.RB0 == 0);
+    if(pb1_raw != pb1_down) {                   //If the input differs from the debounced state, count how long it has done so for
+        pb1_count++;
+        if(pb1_count >= DEBOUNCE_DELAY) {       //Once it has been stable for DEBOUNCE_DELAY ms, accept the new state
+            pb1_count = 0;
+            pb1_down = pb1_raw;
+            if(pb1_raw == 1) {                  //and latch the press for PB1clicked()
+                pb1_edge = 1;
             }
-            else {
-                return(0);
+        }
+    }
+    else {
+        pb1_count = 0;                          //Any bounce back to the debounced state restarts the count
+    }
+    if(pb2_raw != pb2_down) {
+        pb2_count++;
+        if(pb2_count >= DEBOUNCE_DELAY) {
+            pb2_count = 0;
+            pb2_down = pb2_raw;
+            if(pb2_raw == 1) {
+                pb2_edge = 1;
             }
-        default :
-            return(0);
+        }
     }
-    return(0);
-}
\ No newline at end of file
+    else {
+        pb2_count = 0;
+    }
+}
+
+void ConfigureIO(void) {
+    ADCON1 = 0x3F;
+    TRISF = 0x00;
+    TRISH = 0xFC;
+    TRISA = 0xEF;
+    TRISB = 0xFF;
+    TRISC = 0xFF;
+    TRISJ = 0xBF; 
+}
+
+void BootTest(void) {
+    disp_LEDS = 0xFF;
+    disp_U1 = 0x00;
+    disp_U2 = 0x00;
+    ToneStart(C5, SEMIBREVE);
+    while (ToneBusy()) {
+    }
+    disp_LEDS = 0x00;
+    disp_U1 = 0xFF & dp_mask;
+    disp_U2 = 0xFF;
+    Delay10KTCYx(250);
+}
+
+//Date arithmetic. The clock only covers 2000-2099 (see SetYear()), so every fourth year is a leap year, and a date can be turned into a count of days
+//(and back again) in a fixed no. of steps using only shifts, small multiplies and look-ups in DaysBeforeMonth[]. Divisions are replaced by
+//multiplying by a scaled reciprocal, with the scale factors checked against every value they are used on
+char CalcLeapYear(unsigned int year) {
+    return((year & 0x03) == 0);             //2000 is a leap year and 2100 is never reached, so the century rules aren't needed
+}
+
+unsigned int DaysFromCivil(volatile DATE *d) {
+    char y = d->year_short;
+    return(YEAR_START(y) + MONTH_START(d->month, (y & 0x03) == 0) + d->day - 1);
+}
+
+void CivilFromDays(unsigned int days, volatile DATE *d) {
+    char y, month, leap;
+    y = ((unsigned long)days * 179) >> 16;  //days / 366.1, which is never more than one year less than the actual year,
+    if (days >= YEAR_START(y + 1)) {        //so move on a year if days is past the start of the next one
+        y++;
+    }
+    days -= YEAR_START(y);                  //Day of the year, from 0
+    leap = ((y & 0x03) == 0);
+    month = (days >> 5) + 1;                //Likewise days / 32 is never more than one month less than the actual month
+    if (days >= MONTH_START(month + 1, leap)) {
+        month++;
+    }
+    d->day = days - MONTH_START(month, leap) + 1;
+    d->month = month;
+    d->year_short = y;
+    d->year_long = EPOCH_YEAR + y;
+}
+
+char Weekday(unsigned int days) {
+    unsigned int q;
+    days += 6;                              //01/01/2000 was a Saturday (6)
+    q = ((unsigned long)days * 18725) >> 17;    //days / 7
+    return(days - ((q << 3) - q));
+}
+
+unsigned int EpochDays(unsigned long e) {
+    unsigned int days;
+    unsigned long start;
+    days = ((e >> 16) * 24855) >> 15;       //e / SECS_PER_DAY from the top 16 bits of e, which is at most one day out either way
+    start = (unsigned long)days * SECS_PER_DAY;
+    if (start > e) {
+        days--;
+    } else if ((e - start) >= SECS_PER_DAY) {
+        days++;
+    }
+    return(days);
+}
+
+unsigned long DateToEpoch(volatile DATE *d, volatile TIME *t) {
+    return(((unsigned long)DaysFromCivil(d) * SECS_PER_DAY) + ((unsigned long)t->hrs * 3600) + ((unsigned int)t->mins * 60) + t->secs);
+}
+
+void EpochToDate(unsigned long e, volatile DATE *d, volatile TIME *t) {
+    unsigned int days, secs;
+    char hrs, mins;
+    days = EpochDays(e);
+    CivilFromDays(days, d);
+    e -= (unsigned long)days * SECS_PER_DAY;        //Seconds into the day
+    hrs = (e * 37283) >> 27;                        //e / 3600
+    secs = e - ((unsigned long)hrs * 3600);         //Seconds into the hour, which fits in an int
+    mins = ((unsigned long)secs * 2185) >> 17;      //secs / 60
+    t->hrs = hrs;
+    t->mins = mins;
+    t->secs = secs - ((unsigned int)mins * 60);
+}
+
+void UpdateMainTime(void) {
+    unsigned long now;
+    TIME t;
+    DATE d;
+    now = GetEpoch();
+    if (now == main_epoch) {                                    //The date/time only needs working out again once a second
+        return;
+    }
+    if ((main_epoch != NO_ALARM) && (now == (main_epoch + 1))) {  //Normally it is one second on, so count it on in BCD,
+        main_epoch = now;
+        if ((BcdInc(&MainClock.secs, 0x59) == 0) || (BcdInc(&MainClock.mins, 0x59) == 0) || (BcdInc(&MainClock.hrs, 0x23) == 0)) {
+            return;                                             //unless it is midnight, when the date needs working out
+        }
+    }
+    main_epoch = now;
+    EpochToDate(now, &d, &t);
+    MainClock.day = Bin2Bcd(d.day);
+    MainClock.month = Bin2Bcd(d.month);
+    MainClock.year = Bin2Bcd(d.year_short);
+    MainClock.hrs = Bin2Bcd(t.hrs);
+    MainClock.mins = Bin2Bcd(t.mins);
+    MainClock.secs = Bin2Bcd(t.secs);
+}
+
+char WrapStep(char value, char first, char last, signed char step) {
+    if (step > 0) {
+        return((value >= last) ? first : value + 1);
+    } else {
+        return((value <= first) ? last : value - 1);
+    }
+}
+
+void StepField(char field, TIME *t, DATE *d, signed char step) {
+    char last;
+    switch (field) {
+        case(SECS):
+            t->secs = WrapStep(t->secs, 0, 59, step);
+            break;
+        case(MINS):
+            t->mins = WrapStep(t->mins, 0, 59, step);
+            break;
+        case(HRS):
+            t->hrs = WrapStep(t->hrs, 0, 23, step);
+            break;
+        case(MONTH):
+            d->month = WrapStep(d->month, 1, 12, step);
+            break;
+        case(YEAR):
+            d->year_short = WrapStep(d->year_short, 0, 99, step);
+            d->year_long = EPOCH_YEAR + d->year_short;
+            break;
+        default:
+            break;
+    }
+    last = CalcLeapYear(d->year_long) ? DaysInMonthLeap[d->month] : DaysInMonth[d->month];
+    if (field == DAY) {
+        d->day = WrapStep(d->day, 1, last, step);
+    } else if (d->day > last) {             //Keep the day within the month if the month/year has been changed under it
+        d->day = last;
+    }
+}
+
+char FieldValue(char field, TIME *t, DATE *d) {
+    switch (field) {
+        case(SECS):
+            return(t->secs);
+        case(MINS):
+            return(t->mins);
+        case(HRS):
+            return(t->hrs);
+        case(DAY):
+            return(d->day);
+        case(MONTH):
+            return(d->month);
+        default:
+            return(d->year_short);
+    }
+}
+
+void FieldName(char field) {
+    switch (field) {                        //'SS', 'mi', 'hh', 'dd', 'mo' or 'yy'
+        case(SECS):
+            disp_U2 = DispChars.S;
+            disp_U1 = DispChars.S & dp_mask;
+            break;
+        case(MINS):
+            disp_U2 = DispChars.M;
+            disp_U1 = DispChars.i & dp_mask;
+            break;
+        case(HRS):
+            disp_U2 = DispChars.h;
+            disp_U1 = DispChars.h & dp_mask;
+            break;
+        case(DAY):
+            disp_U2 = DispChars.d;
+            disp_U1 = DispChars.d & dp_mask;
+            break;
+        case(MONTH):
+            disp_U2 = DispChars.M;
+            disp_U1 = DispChars.o & dp_mask;
+            break;
+        default:
+            disp_U2 = DispChars.y;
+            disp_U1 = DispChars.y & dp_mask;
+            break;
+    }
+}
+
+void AlarmNumDisp(char n) {
+    n++;                                        //Alarms are numbered from 1 on the display
+    if (n < 10) {
+        disp_U2 = DispChars.A;
+        disp_U1 = DispNums[n] & dp_mask;
+    } else {
+        Num2Disp(Bin2Bcd(n));
+    }
+}
+
+void SoundAlarm(char n) {
+    AlarmNumDisp(n);
+    disp_LEDS = 0xFF;
+    MelodyStart(Melodies[alarms[n].flags & ALARM_MELODY]);  //Melody plays in the background until the alarm is acknowledged
+    alarm_sounding = n + 1;
+}
\ No newline at end of file
@@ -0,0 +1,235 @@
+/*
+ * Name: clockctl.c
+ * Description:
+ * >Host client for the clock's UART command channel (see UartCommand() in mini-project-clock.c). Talks to the clock through a serial
+ *  port, or to the simulator through the pseudo-terminal it prints when run with -U
+ *
+ * >Each command is sent as a frame: 0xA5, command, no. of data bytes, data, CRC-16 (CCITT, from 0xFFFF, over the command, length & data,
+ *  low byte first). A 0x00 is sent before it, which the firmware skips, to wake the clock if it is in standby. The reply has the same layout,
+ *  with 0x80 ORed into the command and a status byte before its data. If no good reply comes within REPLY_TIMEOUT_MS the command is sent
+ *  again, up to TRIES times
+ *
+ * Usage: clockctl <port> <command> [arguments]
+ *      get-time                                        Print the time & the RTC trim
+ *      set-time <seconds since 01/01/2000|now>         Set the time. "now" is the host's local time
+ *      get-alarm <n>                                   Print alarm n
+ *      set-alarm <n> <hh:mm:ss> <dd/mm/yy> <flags> <repeat>
+ *                                                      Set alarm n. flags & repeat are as ALARM.flags & ALARM.repeat, e.g. 0x80 0x7F
+ *                                                      for on, melody 0, every day. The date is only used if flags has ALARM_DATED (0x40)
+ *      counters                                        Print the event counters
+ *      gps                                             Print whether the GPS has a fix & the RTC is locked to it, the RTC's offset at the
+ *                                                      last PPS used (crystal ticks of 1/32768s) & the loop's estimate of the crystal's error
+ *
+ * Exit status is 0 if the clock replied OK, 1 if it replied with an error status, 2 if it didn't reply or the arguments were wrong
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNC 0xA5
+#define REPLY 0x80
+#define MAX_DATA 19
+#define REPLY_TIMEOUT_MS 500
+#define TRIES 3
+#define EPOCH_UNIX 946684800L       //Unix time of 00:00:00 01/01/2000, the clock's epoch
+
+#define CMD_GET_TIME 0x01
+#define CMD_SET_TIME 0x02
+#define CMD_GET_ALARM 0x03
+#define CMD_SET_ALARM 0x04
+#define CMD_GET_COUNTERS 0x05
+#define CMD_GET_GPS 0x06
+
+static const char *Statuses[] = { "OK", "unknown command", "wrong length", "value out of range", "busy (setting menu in use)" };
+static const char *Counters[] = { "frames", "errors", "overruns", "dropped", "saves", "alarms", "gps", "steps", "radio" };
+
+static int fd;
+
+//CRC-16 CCITT, as Crc16() in the firmware
+static unsigned int Crc16(unsigned int crc, unsigned char b) {
+    int i;
+    crc ^= (unsigned int)b << 8;
+    for (i = 0; i < 8; i++)
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    return(crc & 0xFFFF);
+}
+
+//Reads one byte, waiting up to until_ms (CLOCK_MONOTONIC) for it. Returns the byte, or -1 on timing out
+static int ReadByte(long long until_ms) {
+    struct timespec now;
+    struct pollfd p = { fd, POLLIN, 0 };
+    unsigned char b;
+    long long left;
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = until_ms - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (left <= 0 || poll(&p, 1, (int)left) <= 0)
+            return(-1);
+        if (read(fd, &b, 1) == 1)
+            return(b);
+    }
+}
+
+//Sends the command & waits for its reply. Returns the no. of reply data bytes (after the status) in reply[], or -1 if there was no reply
+static int Transact(unsigned char cmd, const unsigned char *data, int n, unsigned char *status, unsigned char *reply) {
+    unsigned char frame[MAX_DATA + 6], in[MAX_DATA + 6];
+    unsigned int crc;
+    struct timespec now;
+    long long until;
+    int i, b, len, tries;
+    frame[0] = 0x00;
+    frame[1] = SYNC;
+    frame[2] = cmd;
+    frame[3] = n;
+    memcpy(frame + 4, data, n);
+    for (crc = 0xFFFF, i = 2; i < n + 4; i++)
+        crc = Crc16(crc, frame[i]);
+    frame[n + 4] = crc & 0xFF;
+    frame[n + 5] = crc >> 8;
+    for (tries = 0; tries < TRIES; tries++) {
+        tcflush(fd, TCIFLUSH);
+        if (write(fd, frame, n + 6) != n + 6) {
+            perror("write");
+            return(-1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        until = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + REPLY_TIMEOUT_MS;
+        len = 0;
+        while ((b = ReadByte(until)) >= 0) {
+            if (len == 0 && b != SYNC)
+                continue;
+            in[len++] = b;
+            if (len == 3 && (b < 1 || b > MAX_DATA)) {
+                len = 0;
+            } else if (len > 3 && len == in[2] + 5) {
+                for (crc = 0xFFFF, i = 1; i < len - 2; i++)
+                    crc = Crc16(crc, in[i]);
+                if (in[1] == (cmd | REPLY) && in[len - 2] == (crc & 0xFF) && in[len - 1] == (crc >> 8)) {
+                    *status = in[3];
+                    memcpy(reply, in + 4, in[2] - 1);
+                    return(in[2] - 1);
+                }
+                len = 0;
+            }
+        }
+    }
+    return(-1);
+}
+
+static unsigned long GetLong(const unsigned char *p) {
+    return(p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24));
+}
+
+static void PutLong(unsigned char *p, unsigned long v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+static void PrintTime(unsigned long epoch) {
+    time_t t = EPOCH_UNIX + (time_t)epoch;
+    struct tm tm;
+    char buf[32];
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%H:%M:%S %d/%m/%Y", &tm);
+    printf("%s (%lu)", buf, epoch);
+}
+
+static int Usage(const char *argv0) {
+    fprintf(stderr, "usage: %s <port> get-time | set-time <secs|now> | get-alarm <n> | set-alarm <n> <hh:mm:ss> <dd/mm/yy> <flags> <repeat> | counters | gps\n",
+            argv0);
+    return(2);
+}
+
+int main(int argc, char **argv) {
+    struct termios tio;
+    unsigned char data[MAX_DATA], reply[MAX_DATA], status, cmd;
+    unsigned int v[6];
+    int n = 0, got, i;
+    time_t now;
+    struct tm tm;
+    if (argc < 3)
+        return(Usage(argv[0]));
+    if (strcmp(argv[2], "get-time") == 0 && argc == 3) {
+        cmd = CMD_GET_TIME;
+    } else if (strcmp(argv[2], "set-time") == 0 && argc == 4) {
+        cmd = CMD_SET_TIME;
+        if (strcmp(argv[3], "now") == 0) {
+            now = time(NULL);
+            localtime_r(&now, &tm);
+            PutLong(data, (unsigned long)(now + tm.tm_gmtoff - EPOCH_UNIX));    //The clock keeps local time
+        } else {
+            PutLong(data, strtoul(argv[3], NULL, 0));
+        }
+        n = 4;
+    } else if (strcmp(argv[2], "get-alarm") == 0 && argc == 4) {
+        cmd = CMD_GET_ALARM;
+        data[0] = strtoul(argv[3], NULL, 0);
+        n = 1;
+    } else if (strcmp(argv[2], "set-alarm") == 0 && argc == 8) {
+        cmd = CMD_SET_ALARM;
+        if (sscanf(argv[4], "%u:%u:%u", &v[0], &v[1], &v[2]) != 3 || sscanf(argv[5], "%u/%u/%u", &v[3], &v[4], &v[5]) != 3)
+            return(Usage(argv[0]));
+        data[0] = strtoul(argv[3], NULL, 0);
+        for (i = 0; i < 6; i++)
+            data[i + 1] = v[i] % 256;
+        data[7] = strtoul(argv[6], NULL, 0);
+        data[8] = strtoul(argv[7], NULL, 0);
+        n = 9;
+    } else if (strcmp(argv[2], "counters") == 0 && argc == 3) {
+        cmd = CMD_GET_COUNTERS;
+    } else if (strcmp(argv[2], "gps") == 0 && argc == 3) {
+        cmd = CMD_GET_GPS;
+    } else {
+        return(Usage(argv[0]));
+    }
+
+    if ((fd = open(argv[1], O_RDWR | O_NOCTTY)) < 0) {
+        perror(argv[1]);
+        return(2);
+    }
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B9600);
+        cfsetospeed(&tio, B9600);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    if ((got = Transact(cmd, data, n, &status, reply)) < 0) {
+        fprintf(stderr, "%s: no reply\n", argv[1]);
+        return(2);
+    }
+    if (status != 0) {
+        fprintf(stderr, "%s\n", status < sizeof(Statuses) / sizeof(Statuses[0]) ? Statuses[status] : "error");
+        return(1);
+    }
+    switch (cmd) {
+        case(CMD_GET_TIME):
+            PrintTime(GetLong(reply));
+            printf(", trim %d\n", (signed short)(reply[4] | (reply[5] << 8)));
+            break;
+        case(CMD_GET_ALARM):
+            printf("Alarm %u: %02u:%02u:%02u %02u/%02u/%02u, flags 0x%02X, repeat 0x%02X\n", reply[0], reply[1], reply[2], reply[3],
+                   reply[4], reply[5], reply[6], reply[7], reply[8]);
+            break;
+        case(CMD_GET_COUNTERS):
+            for (i = 0; i < got / 2 && i < (int)(sizeof(Counters) / sizeof(Counters[0])); i++)
+                printf("%-10s %u\n", Counters[i], reply[2 * i] | (reply[(2 * i) + 1] << 8));
+            break;
+        case(CMD_GET_GPS):
+            printf("%s, %s, offset %d ticks, trim estimate %+.1f ppm\n", (reply[0] & 0x01) ? "fix" : "no fix", (reply[0] & 0x02) ? "locked" : "not locked",
+                   (signed short)(reply[1] | (reply[2] << 8)), (signed short)(reply[3] | (reply[4] << 8)) / 32.0);
+            break;
+        default:
+            printf("OK\n");
+            break;
+    }
+    return(0);
+}
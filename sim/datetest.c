@@ -0,0 +1,111 @@
+/*
+ * Name: datetest.c
+ * Description:
+ * >Host test of the firmware's date/time arithmetic (DaysFromCivil(), CivilFromDays(), Weekday(), EpochDays(), DateToEpoch() &
+ *  EpochToDate() in mini-project-clock.c), which use multiply & shift in place of division and so are easy to get wrong by a day at
+ *  the edges. The firmware is compiled for the host as it is for the simulator, but without the instrumentation, and only the functions
+ *  called here are linked (--gc-sections), so none of the registers or library functions the rest of it uses are needed
+ *
+ * >Every day from 01/01/2000 to 31/12/2099 is checked against the host's gmtime(): the day, month & year, the weekday, and that
+ *  the days -> date -> days round trip gives the same day. EpochDays() & DateToEpoch() are checked at the first & last second of
+ *  every day and the last second of the day before, and EpochToDate() & DateToEpoch() at every second of 31/12/2099, the day with
+ *  the largest epoch_secs
+ *
+ * Usage: datetest
+ *      Prints each mismatch (up to MAX_ERRORS) & a summary. Exit status is 0 if everything matched, 1 if not
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#define EPOCH_UNIX 946684800L   //00:00:00 01/01/2000 in Unix time
+#define SECS_PER_DAY 86400UL
+#define DAYS 36525              //01/01/2000 to 31/12/2099
+#define MAX_ERRORS 20
+
+//As TIME & DATE in mini-project-clock.c
+typedef struct {
+    char hrs;
+    char mins;
+    char secs;
+} TIME;
+
+typedef struct {
+    char day;
+    char month;
+    char year_short;
+    unsigned int year_long;
+} DATE;
+
+unsigned int DaysFromCivil(volatile DATE *d);
+void CivilFromDays(unsigned int days, volatile DATE *d);
+char Weekday(unsigned int days);
+unsigned int EpochDays(unsigned long e);
+unsigned long DateToEpoch(volatile DATE *d, volatile TIME *t);
+void EpochToDate(unsigned long e, volatile DATE *d, volatile TIME *t);
+
+static unsigned long checks = 0, errors = 0;
+
+static void Check(int ok, const char *what, unsigned long e, long got, long want) {
+    struct tm tm;
+    time_t t = EPOCH_UNIX + (time_t)e;
+    checks++;
+    if (ok)
+        return;
+    if (++errors <= MAX_ERRORS) {
+        gmtime_r(&t, &tm);
+        printf("%04d-%02d-%02d %02d:%02d:%02d (epoch %lu): %s is %ld, should be %ld\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+               tm.tm_hour, tm.tm_min, tm.tm_sec, e, what, got, want);
+    }
+}
+
+#define CHECK(what, e, got, want) Check((long)(got) == (long)(want), what, e, got, want)
+
+static void CheckDay(unsigned int days) {
+    unsigned long e = (unsigned long)days * SECS_PER_DAY;
+    time_t t = EPOCH_UNIX + (time_t)e;
+    struct tm tm;
+    DATE d;
+    TIME midnight = {0, 0, 0}, last = {23, 59, 59};
+    gmtime_r(&t, &tm);
+    CivilFromDays(days, &d);
+    CHECK("CivilFromDays() day", e, d.day, tm.tm_mday);
+    CHECK("CivilFromDays() month", e, d.month, tm.tm_mon + 1);
+    CHECK("CivilFromDays() year_short", e, d.year_short, tm.tm_year - 100);
+    CHECK("CivilFromDays() year_long", e, d.year_long, tm.tm_year + 1900);
+    CHECK("Weekday()", e, Weekday(days), tm.tm_wday);
+    CHECK("DaysFromCivil(CivilFromDays())", e, DaysFromCivil(&d), days);
+    CHECK("EpochDays() at 00:00:00", e, EpochDays(e), days);
+    CHECK("EpochDays() at 23:59:59", e + SECS_PER_DAY - 1, EpochDays(e + SECS_PER_DAY - 1), days);
+    if (days > 0)
+        CHECK("EpochDays() at 23:59:59 the day before", e - 1, EpochDays(e - 1), days - 1);
+    CHECK("DateToEpoch() at 00:00:00", e, DateToEpoch(&d, &midnight), e);
+    CHECK("DateToEpoch() at 23:59:59", e + SECS_PER_DAY - 1, DateToEpoch(&d, &last), e + SECS_PER_DAY - 1);
+}
+
+static void CheckSecond(unsigned long e) {
+    time_t t = EPOCH_UNIX + (time_t)e;
+    struct tm tm;
+    DATE d;
+    TIME tt;
+    gmtime_r(&t, &tm);
+    EpochToDate(e, &d, &tt);
+    CHECK("EpochToDate() day", e, d.day, tm.tm_mday);
+    CHECK("EpochToDate() month", e, d.month, tm.tm_mon + 1);
+    CHECK("EpochToDate() year_long", e, d.year_long, tm.tm_year + 1900);
+    CHECK("EpochToDate() hrs", e, tt.hrs, tm.tm_hour);
+    CHECK("EpochToDate() mins", e, tt.mins, tm.tm_min);
+    CHECK("EpochToDate() secs", e, tt.secs, tm.tm_sec);
+    CHECK("DateToEpoch(EpochToDate())", e, DateToEpoch(&d, &tt), e);
+}
+
+int main(void) {
+    unsigned int days;
+    unsigned long s;
+    for (days = 0; days < DAYS; days++)
+        CheckDay(days);
+    for (s = 0; s < SECS_PER_DAY; s++)
+        CheckSecond((DAYS - 1) * SECS_PER_DAY + s);
+    printf("datetest: %lu checks, %lu failed\n", checks, errors);
+    return(errors != 0);
+}
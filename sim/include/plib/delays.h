@@ -0,0 +1,16 @@
+/*
+ * Name: plib/delays.h (host simulator)
+ * Description: Stand-in for the C18 peripheral library delay functions used by the firmware. Implemented in sim.c, where each call
+ *              advances the virtual instruction clock by exactly the number of TCY requested
+ */
+
+#ifndef SIM_PLIB_DELAYS_H
+#define SIM_PLIB_DELAYS_H
+
+void Delay1TCY(void);
+void Delay10TCYx(unsigned char unit);
+void Delay100TCYx(unsigned char unit);
+void Delay1KTCYx(unsigned char unit);
+void Delay10KTCYx(unsigned char unit);
+
+#endif /* SIM_PLIB_DELAYS_H */
@@ -0,0 +1,16 @@
+/*
+ * Name: plib/timers.h (host simulator)
+ * Description: Stand-in for the C18 peripheral library timer functions used by the firmware. Implemented in sim.c
+ */
+
+#ifndef SIM_PLIB_TIMERS_H
+#define SIM_PLIB_TIMERS_H
+
+void WriteTimer0(unsigned int timer0);
+void WriteTimer1(unsigned int timer1);
+void WriteTimer3(unsigned int timer3);
+unsigned int ReadTimer0(void);
+unsigned int ReadTimer1(void);
+unsigned int ReadTimer3(void);
+
+#endif /* SIM_PLIB_TIMERS_H */
@@ -0,0 +1,244 @@
+/*
+ * Name: xc.h (host simulator)
+ * Description:
+ * >Stand-in for the XC8 device header when mini-project-clock.c is built for the Linux host simulator (see sim/sim.c)
+ * >Every special function register used by the firmware is declared as a union so that the byte-wide name (e.g. PORTJ) and the
+ *  bit-field name (e.g. PORTJbits) alias the same storage, as they do on the PIC18F8722. The registers themselves are defined in sim.c,
+ *  which also models the timers, CCP modules and interrupt controller using them
+ * >Only the registers/bits used by the firmware are declared here. Add to this file if the firmware starts using a new SFR
+ */
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+//XC8 keywords which have no meaning on the host
+#define interrupt
+#define low_priority
+
+#define Nop()
+#define Sleep() SimSleep()      //SLEEP instruction, modelled by the simulator
+void SimSleep(void);
+#define ClrWdt()
+
+//Declares the storage for one 8-bit SFR, with byte (name) and bit-field (name##bits) views
+#define SIM_SFR(name, ...) \
+        typedef union { \
+            unsigned char byte; \
+            struct { __VA_ARGS__ } bits; \
+        } name##_t; \
+        extern volatile name##_t sfr_##name;
+
+//Generic 8-bit ports/latches, all with numbered bits
+#define SIM_PORT(name, p) \
+        SIM_SFR(name, unsigned char p##0:1; unsigned char p##1:1; unsigned char p##2:1; unsigned char p##3:1; \
+                      unsigned char p##4:1; unsigned char p##5:1; unsigned char p##6:1; unsigned char p##7:1;)
+
+SIM_PORT(PORTA, RA)
+SIM_PORT(PORTB, RB)
+SIM_PORT(PORTC, RC)
+SIM_PORT(PORTH, RH)
+SIM_PORT(PORTJ, RJ)
+SIM_PORT(LATA, LA)
+SIM_PORT(LATF, LATF)
+SIM_PORT(LATH, LH)
+SIM_PORT(LATJ, LATJ)
+SIM_PORT(TRISA, TRISA)
+SIM_PORT(TRISB, TRISB)
+SIM_PORT(TRISC, TRISC)
+SIM_PORT(TRISF, TRISF)
+SIM_PORT(TRISH, TRISH)
+SIM_PORT(TRISJ, TRISJ)
+
+SIM_SFR(INTCON, unsigned char RBIF:1; unsigned char INT0IF:1; unsigned char TMR0IF:1; unsigned char RBIE:1;
+                unsigned char INT0IE:1; unsigned char TMR0IE:1; unsigned char PEIE:1; unsigned char GIE:1;)
+SIM_SFR(INTCON2, unsigned char RBIP:1; unsigned char INT3IP:1; unsigned char TMR0IP:1; unsigned char INTEDG3:1;
+                 unsigned char INTEDG2:1; unsigned char INTEDG1:1; unsigned char INTEDG0:1; unsigned char RBPU:1;)
+SIM_SFR(INTCON3, unsigned char INT1IF:1; unsigned char INT2IF:1; unsigned char INT3IF:1; unsigned char INT1IE:1;
+                 unsigned char INT2IE:1; unsigned char INT3IE:1; unsigned char INT1IP:1; unsigned char INT2IP:1;)
+SIM_SFR(RCON, unsigned char BOR:1; unsigned char POR:1; unsigned char PD:1; unsigned char TO:1;
+              unsigned char RI:1; unsigned char :1; unsigned char SBOREN:1; unsigned char IPEN:1;)
+SIM_SFR(PIR1, unsigned char TMR1IF:1; unsigned char TMR2IF:1; unsigned char CCP1IF:1; unsigned char SSP1IF:1;
+              unsigned char TX1IF:1; unsigned char RC1IF:1; unsigned char ADIF:1; unsigned char PSPIF:1;)
+SIM_SFR(PIE1, unsigned char TMR1IE:1; unsigned char TMR2IE:1; unsigned char CCP1IE:1; unsigned char SSP1IE:1;
+              unsigned char TX1IE:1; unsigned char RC1IE:1; unsigned char ADIE:1; unsigned char PSPIE:1;)
+SIM_SFR(IPR1, unsigned char TMR1IP:1; unsigned char TMR2IP:1; unsigned char CCP1IP:1; unsigned char SSP1IP:1;
+              unsigned char TX1IP:1; unsigned char RC1IP:1; unsigned char ADIP:1; unsigned char PSPIP:1;)
+SIM_SFR(T0CON, unsigned char T0PS:3; unsigned char PSA:1; unsigned char T0SE:1; unsigned char T0CS:1;
+               unsigned char T08BIT:1; unsigned char TMR0ON:1;)
+SIM_SFR(T1CON, unsigned char TMR1ON:1; unsigned char TMR1CS:1; unsigned char T1SYNC:1; unsigned char T1OSCEN:1;
+               unsigned char T1CKPS:2; unsigned char T1RUN:1; unsigned char RD16:1;)
+SIM_SFR(TMR0L, unsigned char :8;)
+SIM_SFR(TMR0H, unsigned char :8;)
+SIM_SFR(TMR1L, unsigned char :8;)
+SIM_SFR(TMR1H, unsigned char :8;)
+SIM_SFR(OSCCON, unsigned char SCS:2; unsigned char IOFS:1; unsigned char OSTS:1; unsigned char IRCF:3; unsigned char IDLEN:1;)
+SIM_SFR(ADCON1, unsigned char PCFG:4; unsigned char VCFG:2; unsigned char :2;)
+SIM_SFR(PIR2, unsigned char CCP2IF:1; unsigned char TMR3IF:1; unsigned char HLVDIF:1; unsigned char BCL1IF:1;
+              unsigned char EEIF:1; unsigned char :1; unsigned char CMIF:1; unsigned char OSCFIF:1;)
+SIM_SFR(PIE2, unsigned char CCP2IE:1; unsigned char TMR3IE:1; unsigned char HLVDIE:1; unsigned char BCL1IE:1;
+              unsigned char EEIE:1; unsigned char :1; unsigned char CMIE:1; unsigned char OSCFIE:1;)
+SIM_SFR(IPR2, unsigned char CCP2IP:1; unsigned char TMR3IP:1; unsigned char HLVDIP:1; unsigned char BCL1IP:1;
+              unsigned char EEIP:1; unsigned char :1; unsigned char CMIP:1; unsigned char OSCFIP:1;)
+SIM_SFR(PIR3, unsigned char CCP3IF:1; unsigned char CCP4IF:1; unsigned char CCP5IF:1; unsigned char TMR4IF:1;
+              unsigned char TX2IF:1; unsigned char RC2IF:1; unsigned char BCL2IF:1; unsigned char SSP2IF:1;)
+SIM_SFR(PIE3, unsigned char CCP3IE:1; unsigned char CCP4IE:1; unsigned char CCP5IE:1; unsigned char TMR4IE:1;
+              unsigned char TX2IE:1; unsigned char RC2IE:1; unsigned char BCL2IE:1; unsigned char SSP2IE:1;)
+SIM_SFR(IPR3, unsigned char CCP3IP:1; unsigned char CCP4IP:1; unsigned char CCP5IP:1; unsigned char TMR4IP:1;
+              unsigned char TX2IP:1; unsigned char RC2IP:1; unsigned char BCL2IP:1; unsigned char SSP2IP:1;)
+SIM_SFR(T3CON, unsigned char TMR3ON:1; unsigned char TMR3CS:1; unsigned char T3SYNC:1; unsigned char T3CCP1:1;
+               unsigned char T3CKPS:2; unsigned char T3CCP2:1; unsigned char RD16:1;)
+SIM_SFR(TMR3L, unsigned char :8;)
+SIM_SFR(TMR3H, unsigned char :8;)
+SIM_SFR(CCP3CON, unsigned char CCP3M:4; unsigned char DC3B:2; unsigned char :2;)
+SIM_SFR(CCP4CON, unsigned char CCP4M:4; unsigned char DC4B:2; unsigned char :2;)
+SIM_SFR(CCP5CON, unsigned char CCP5M:4; unsigned char DC5B:2; unsigned char :2;)
+SIM_SFR(EECON1, unsigned char RD:1; unsigned char WR:1; unsigned char WREN:1; unsigned char WRERR:1;
+                unsigned char FREE:1; unsigned char :1; unsigned char CFGS:1; unsigned char EEPGD:1;)
+SIM_SFR(HLVDCON, unsigned char HLVDL:4; unsigned char HLVDEN:1; unsigned char IRVST:1; unsigned char :1; unsigned char VDIRMAG:1;)
+SIM_SFR(EECON2, unsigned char :8;)
+SIM_SFR(EEADR, unsigned char :8;)
+SIM_SFR(EEADRH, unsigned char :8;)
+SIM_SFR(EEDATA, unsigned char :8;)
+SIM_SFR(TXSTA1, unsigned char TX9D:1; unsigned char TRMT:1; unsigned char BRGH:1; unsigned char SENDB:1;
+                unsigned char SYNC:1; unsigned char TXEN:1; unsigned char TX9:1; unsigned char CSRC:1;)
+SIM_SFR(RCSTA1, unsigned char RX9D:1; unsigned char OERR:1; unsigned char FERR:1; unsigned char ADDEN:1;
+                unsigned char CREN:1; unsigned char SREN:1; unsigned char RX9:1; unsigned char SPEN:1;)
+SIM_SFR(BAUDCON1, unsigned char ABDEN:1; unsigned char WUE:1; unsigned char :1; unsigned char BRG16:1;
+                  unsigned char TXCKP:1; unsigned char RXDTP:1; unsigned char RCIDL:1; unsigned char ABDOVF:1;)
+SIM_SFR(SPBRG1, unsigned char :8;)
+SIM_SFR(SPBRGH1, unsigned char :8;)
+SIM_SFR(TXREG1, unsigned char :8;)
+SIM_SFR(RCREG1, unsigned char :8;)
+SIM_SFR(TXSTA2, unsigned char TX9D:1; unsigned char TRMT:1; unsigned char BRGH:1; unsigned char SENDB:1;
+                unsigned char SYNC:1; unsigned char TXEN:1; unsigned char TX9:1; unsigned char CSRC:1;)
+SIM_SFR(RCSTA2, unsigned char RX9D:1; unsigned char OERR:1; unsigned char FERR:1; unsigned char ADDEN:1;
+                unsigned char CREN:1; unsigned char SREN:1; unsigned char RX9:1; unsigned char SPEN:1;)
+SIM_SFR(BAUDCON2, unsigned char ABDEN:1; unsigned char WUE:1; unsigned char :1; unsigned char BRG16:1;
+                  unsigned char TXCKP:1; unsigned char RXDTP:1; unsigned char RCIDL:1; unsigned char ABDOVF:1;)
+SIM_SFR(SPBRG2, unsigned char :8;)
+SIM_SFR(SPBRGH2, unsigned char :8;)
+SIM_SFR(TXREG2, unsigned char :8;)
+SIM_SFR(RCREG2, unsigned char :8;)
+
+//16-bit capture/compare registers, with the low/high byte views the firmware may also use
+typedef union {
+    unsigned short word;
+    struct { unsigned char low; unsigned char high; } bytes;
+} CCPR_t;
+extern volatile CCPR_t sfr_CCPR3;
+extern volatile CCPR_t sfr_CCPR4;
+extern volatile CCPR_t sfr_CCPR5;
+
+#define PORTA sfr_PORTA.byte
+#define PORTAbits sfr_PORTA.bits
+#define PORTB sfr_PORTB.byte
+#define PORTBbits sfr_PORTB.bits
+#define PORTC sfr_PORTC.byte
+#define PORTCbits sfr_PORTC.bits
+#define PORTH sfr_PORTH.byte
+#define PORTHbits sfr_PORTH.bits
+#define PORTJ sfr_PORTJ.byte
+#define PORTJbits sfr_PORTJ.bits
+#define LATA sfr_LATA.byte
+#define LATAbits sfr_LATA.bits
+#define LATF sfr_LATF.byte
+#define LATFbits sfr_LATF.bits
+#define LATH sfr_LATH.byte
+#define LATHbits sfr_LATH.bits
+#define LATJ sfr_LATJ.byte
+#define LATJbits sfr_LATJ.bits
+#define TRISA sfr_TRISA.byte
+#define TRISB sfr_TRISB.byte
+#define TRISC sfr_TRISC.byte
+#define TRISF sfr_TRISF.byte
+#define TRISH sfr_TRISH.byte
+#define TRISJ sfr_TRISJ.byte
+#define INTCON sfr_INTCON.byte
+#define INTCONbits sfr_INTCON.bits
+#define INTCON2 sfr_INTCON2.byte
+#define INTCON2bits sfr_INTCON2.bits
+#define INTCON3 sfr_INTCON3.byte
+#define INTCON3bits sfr_INTCON3.bits
+#define RCON sfr_RCON.byte
+#define RCONbits sfr_RCON.bits
+#define PIR1 sfr_PIR1.byte
+#define PIR1bits sfr_PIR1.bits
+#define PIE1 sfr_PIE1.byte
+#define PIE1bits sfr_PIE1.bits
+#define IPR1 sfr_IPR1.byte
+#define IPR1bits sfr_IPR1.bits
+#define T0CON sfr_T0CON.byte
+#define T0CONbits sfr_T0CON.bits
+#define T1CON sfr_T1CON.byte
+#define T1CONbits sfr_T1CON.bits
+#define TMR0L sfr_TMR0L.byte
+#define TMR0H sfr_TMR0H.byte
+#define TMR1L sfr_TMR1L.byte
+#define TMR1H sfr_TMR1H.byte
+#define OSCCON sfr_OSCCON.byte
+#define OSCCONbits sfr_OSCCON.bits
+#define ADCON1 sfr_ADCON1.byte
+#define PIR2 sfr_PIR2.byte
+#define PIR2bits sfr_PIR2.bits
+#define PIE2 sfr_PIE2.byte
+#define PIE2bits sfr_PIE2.bits
+#define IPR2 sfr_IPR2.byte
+#define IPR2bits sfr_IPR2.bits
+#define PIR3 sfr_PIR3.byte
+#define PIR3bits sfr_PIR3.bits
+#define PIE3 sfr_PIE3.byte
+#define PIE3bits sfr_PIE3.bits
+#define IPR3 sfr_IPR3.byte
+#define IPR3bits sfr_IPR3.bits
+#define T3CON sfr_T3CON.byte
+#define T3CONbits sfr_T3CON.bits
+#define TMR3L sfr_TMR3L.byte
+#define TMR3H sfr_TMR3H.byte
+#define CCP3CON sfr_CCP3CON.byte
+#define CCP3CONbits sfr_CCP3CON.bits
+#define CCPR3 sfr_CCPR3.word
+#define CCPR3L sfr_CCPR3.bytes.low
+#define CCPR3H sfr_CCPR3.bytes.high
+#define CCP4CON sfr_CCP4CON.byte
+#define CCP4CONbits sfr_CCP4CON.bits
+#define CCPR4 sfr_CCPR4.word
+#define CCPR4L sfr_CCPR4.bytes.low
+#define CCPR4H sfr_CCPR4.bytes.high
+#define CCP5CON sfr_CCP5CON.byte
+#define CCP5CONbits sfr_CCP5CON.bits
+#define CCPR5 sfr_CCPR5.word
+#define CCPR5L sfr_CCPR5.bytes.low
+#define CCPR5H sfr_CCPR5.bytes.high
+#define EECON1 sfr_EECON1.byte
+#define EECON1bits sfr_EECON1.bits
+#define HLVDCON sfr_HLVDCON.byte
+#define HLVDCONbits sfr_HLVDCON.bits
+#define EECON2 sfr_EECON2.byte
+#define EEADR sfr_EEADR.byte
+#define EEADRH sfr_EEADRH.byte
+#define EEDATA (SimEEDATA()->byte)        //Reading it completes a read started by setting EECON1bits.RD
+volatile EEDATA_t *SimEEDATA(void);
+#define TXSTA1 sfr_TXSTA1.byte
+#define TXSTA1bits sfr_TXSTA1.bits
+#define RCSTA1 sfr_RCSTA1.byte
+#define RCSTA1bits sfr_RCSTA1.bits
+#define BAUDCON1 sfr_BAUDCON1.byte
+#define BAUDCON1bits sfr_BAUDCON1.bits
+#define SPBRG1 sfr_SPBRG1.byte
+#define SPBRGH1 sfr_SPBRGH1.byte
+#define TXREG1 (SimTXREG1()->byte)        //Writing it queues the byte to send, clearing TX1IF until the shift register takes it
+volatile TXREG1_t *SimTXREG1(void);
+#define RCREG1 (SimRCREG1()->byte)        //Reading it takes the oldest byte received from the 2-byte FIFO
+volatile RCREG1_t *SimRCREG1(void);
+#define TXSTA2 sfr_TXSTA2.byte
+#define TXSTA2bits sfr_TXSTA2.bits
+#define RCSTA2 sfr_RCSTA2.byte
+#define RCSTA2bits sfr_RCSTA2.bits
+#define BAUDCON2 sfr_BAUDCON2.byte
+#define BAUDCON2bits sfr_BAUDCON2.bits
+#define SPBRG2 sfr_SPBRG2.byte
+#define SPBRGH2 sfr_SPBRGH2.byte
+#define RCREG2 (SimRCREG2()->byte)
+volatile RCREG2_t *SimRCREG2(void);
+
+#endif /* SIM_XC_H */
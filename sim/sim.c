@@ -0,0 +1,1384 @@
+/*
+ * Name: sim.c
+ * Description:
+ * >Linux host simulator for mini-project-clock.c. The firmware source is compiled unmodified against the stand-in device header in
+ *  sim/include, with -finstrument-functions and -fsanitize-coverage=trace-pc, and with its main() renamed to fw_main()
+ *
+ * >A virtual instruction clock (Fcy = Fosc/4) is advanced by:
+ *      -Every basic block executed by the firmware (fixed cost per block, see -b)
+ *      -Every function call (CALL + RETURN) and interrupt entry (vectoring latency)
+ *      -The C18 delay functions, which advance it by exactly the number of TCY requested
+ *
+ * >Timer0 and Timer3 count instruction cycles and Timer1 counts a virtual 32.768kHz crystal. CCP3/CCP4/CCP5 compare against Timer1 or Timer3
+ *  (selected by T3CCP2:T3CCP1). Overflows and compare matches set the interrupt flags, and the interrupt controller model calls
+ *  hp_secs_count_isr()/lp_isr() according to the IPEN/GIEH/GIEL, enable and priority bits. The ISRs therefore pre-empt the main loop
+ *  (and lp_isr is pre-empted by hp_secs_count_isr) at basic block granularity, as they would on the PIC
+ *
+ * >Sleep() (the SLEEP instruction) stops the firmware until an enabled interrupt flag is set, as on the PIC. With OSCCONbits.IDLEN set
+ *  (idle) everything else keeps running. With it clear (sleep) the instruction clock stops, so only Timer1/Timer3 counting the crystal
+ *  asynchronously (TxSYNC set) and INT0 (PB2, on RB0) can wake it, after the oscillator start-up time. The time spent awake, idle and asleep
+ *  is reported
+ *
+ * >Cycles are charged to whichever firmware function is executing when they elapse (self time, not including callees). At the end of
+ *  the run, the calls and cycles used by each function per simulated second are reported
+ *
+ * >The seconds counted by the firmware's RTC (epoch_secs) from its first tick to its last are compared with the simulated time between
+ *  them, to give the RTC's error in ppm. With -x the crystal can be made to run fast/slow, to check that the firmware's trim corrects it
+ *
+ * >The period of the firmware's 1ms tick is measured between the low-priority interrupts which increment its count (ms_ticks), and its
+ *  average, shortest & longest are reported. The average is what debounce, note lengths & task periods are timed by, the spread is jitter.
+ *  Gaps while asleep (when the tick is stopped) aren't counted
+ *
+ * >The share of the time each of the LEDs, U1 & U2 is enabled is reported, which is what their brightness (and the current they draw)
+ *  follows. With three displays multiplexed, 33.3% is fully on
+ *
+ * >The 1024 byte data EEPROM is modelled. Setting EECON1bits.RD reads the byte at EEADRH:EEADR into EEDATA, and setting EECON1bits.WR
+ *  writes EEDATA to it EE_WRITE_MS later (in sleep too), then clears WR and sets EEIF. With -E the EEPROM is loaded from a file at the start
+ *  of the run and written back to it at the end, so that what the firmware saved can be checked by running it again (a reset). A write
+ *  still in progress at the end is lost, as it would be if the power failed
+ *
+ * >The HLVD is modelled by an HLVD input event, which says whether the supply is below its trip point. The supply doesn't actually fail,
+ *  so a power cut is simulated by the HLVD event then the end of the run (-t) after the firmware's hold-up time, and a run with the same
+ *  -E file after it. 'make bench' also runs powerfail-events.txt against powerfail-budgets.txt, to check the power-fail snapshot is
+ *  written within its worst case
+ *
+ * >EUSART1 is modelled at the baud rate set by SPBRGH1:SPBRG1, BRGH & BRG16 (10 bit times per byte). A byte written to TXREG1 clears TX1IF
+ *  until the shift register takes it, and RCREG1 is read from a 2-byte FIFO, which sets OERR if a third byte arrives while it is full.
+ *  The baud rate generator stops in sleep. With WUE set there, the start of a byte wakes the PIC instead of being received: RC1IF is set
+ *  with RCREG1 reading 0x00, and WUE is cleared. With -U the EUSART is connected to a pseudo-terminal, whose name is printed at the start,
+ *  and the run is paced to the wall clock so that a program on the host can talk to the firmware through it. Without -U nothing is received
+ *  and what is sent is discarded. EUSART2 is modelled the same way
+ *
+ * >GPS receiver (-G). The NMEA file is split into one group of sentences per second (a new group starts when a sentence's time changes or
+ *  its type comes round again, going by the sentences whose checksum is good), and a group is sent to EUSART2 at 9600 baud NMEA_DELAY_MS
+ *  after each PPS, which is a PPS_WIDTH_MS pulse on RB1 (INT1) once every simulated second, starting 1s in. The PPS is true time: at each
+ *  one the time the RTC's second started (its Timer1 overflow) is compared with the time in the group it goes with, and the offset at the
+ *  last and the worst in the second half of the run are reported. The PPS stops when the groups run out. 'make bench' replays gps-nmea.txt,
+ *  which has a few seconds with no fix, a corrupted sentence & a cut off one, against gps-budgets.txt, with the crystal fast (-x 40) and
+ *  slow (-x -40), so the RTC is first stepped back to the GPS and then forwards
+ *
+ * >Radio time-code receiver (-R). RB2 is set to each level in the file in turn, for as long as it says, from the start of the run. At each
+ *  minute mark in it the RTC is compared with the time it names, as for the GPS. 'make bench' replays radio-dcf77-noisy.txt against
+ *  radio-budgets.txt. The clock only stays out of standby (where neither the GPS nor the radio is used) with input, so both replays
+ *  are run with awake-events.txt
+ *
+ * >Benchmark (-B). The cycles each call of a firmware function takes, including its callees but not any ISR which pre-empts it, are measured.
+ *  The best, average & worst are reported for each function named in the budget file, and the simulator exits with status 1 if the worst
+ *  exceeds the function's budget, or if the function wasn't called. With -G it also does if the RTC is 0.5s or more from the GPS at any PPS
+ *  in the second half of the run, i.e. it hasn't locked on or has lost lock. 'make bench' runs bench-events.txt against budgets.txt, which hold the
+ *  budgets for the ISRs (which must fit well inside the 1ms tick) & the display routines
+ *
+ * Usage: micro-clock-sim [-t seconds] [-f fosc_hz] [-x crystal_ppm] [-b cycles_per_block] [-e events_file] [-E eeprom_file] [-G nmea_file] [-R radio_file] [-B budget_file] [-U] [-v]
+ *      -t  Number of seconds to simulate (default 10)
+ *      -f  Oscillator frequency in Hz (default 10MHz, which is what TICK_TCY and the note delays are calculated for)
+ *      -x  Error of the 32.768kHz crystal in ppm, positive if it runs fast (default 0)
+ *      -b  Instruction cycles charged per basic block executed (default 4)
+ *      -e  File of timed input events, one per line: "<time_ms> <PB1|PB2|SW|HLVD> <value>"
+ *          e.g. "1500 PB1 1" presses PB1 1.5s into the run, "1600 PB1 0" releases it, "3000 SW 0x84" sets the toggle switches to 0x84,
+ *          "20000 HLVD 1" drops the supply below the HLVD trip point.
+ *          Lines starting with '#' are ignored
+ *      -E  File holding the 1024 bytes of the data EEPROM. Read at the start if it exists (otherwise the EEPROM starts erased, all 0xFF),
+ *          and written at the end
+ *      -G  File of NMEA sentences, one per line, to replay from a GPS receiver on EUSART2 with its PPS on RB1
+ *      -R  File of the output of a DCF77/MSF receiver to replay on RB2, one "<level> <ms>" per line, and "M <epoch>" where a minute starts
+ *          (epoch seconds since 00:00:00 01/01/2000). Lines starting with '#' are ignored
+ *      -B  File of cycle budgets, one per line: "<function> <worst_cycles>", e.g. "Tick_isr 400". Lines starting with '#' are ignored
+ *      -U  Connect EUSART1 to a pseudo-terminal & run in real time (see sim/clockctl.c for a client)
+ *      -v  Print the contents of the 7-segment displays & LEDs, and the buzzer frequency, once every simulated second
+ *
+ * Notes:
+ * [1] The per-block cost is an average. The figures are for comparing builds of the firmware against each other, not a substitute for
+ *     measuring on the PIC. Delay routines and timer behaviour are exact
+ * [2] The RTC error is only meaningful if the time isn't set during the run. It is measured at the Timer1 overflows which end whole seconds, so a trim correction of
+ *     256 crystal ticks (7.8ms) made part way through shows up as up to 7.8ms / run length. Use long runs (-t 1000 or more) to measure it
+ * [3] The GPS offset is measured at the Timer1 overflow too, so while the firmware slews the RTC it has a sawtooth of up to 7.8ms, as
+ *     the trim is made in steps of 256 crystal ticks. The firmware counts the trim still owed, so its own offset (clockctl gps) is finer
+ * [4] The EEPROM write unlock sequence (EECON2 = 0x55, 0xAA) and WREN aren't checked, so a write the PIC would refuse isn't caught here
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <xc.h>
+#include <plib/timers.h>
+#include <plib/delays.h>
+
+#define CRYSTAL_HZ 32768ULL         //Timer1 oscillator frequency
+#define CALL_CYCLES 4               //CALL + RETURN
+#define ISR_LATENCY_CYCLES 3        //Interrupt vectoring latency
+#define OST_CYCLES 256              //Oscillator start-up timer (1024 Tosc) on waking from sleep
+#define MAX_FUNCS 128
+#define MAX_DEPTH 64
+#define MAX_EVENTS 1024
+#define MAX_BUDGETS 32
+#define EE_SIZE 1024                //Bytes of data EEPROM
+#define EE_WRITE_MS 4               //Time a data EEPROM write takes (TWR)
+#define UART_FIFO 2                 //Depth of the EUSART receive FIFO
+#define PACE_SLACK_NS 1000000LL     //How far the run may get ahead of the wall clock with -U before it waits
+#define MAX_NMEA_GROUPS 4096        //Max. seconds of NMEA sentences replayed (-G)
+#define PPS_WIDTH_MS 100            //Length of the GPS receiver's PPS pulse
+#define NMEA_DELAY_MS 50            //Time from the PPS to the receiver starting to send the sentences naming its second
+#define MAX_RADIO_RUNS 100000       //Max. no. of levels of the radio time-code receiver's output replayed (-R)
+
+//Firmware entry points & tables (mini-project-clock.c)
+void fw_main(void);
+void hp_secs_count_isr(void);
+void lp_isr(void);
+extern const char DispNums[];
+extern volatile unsigned long epoch_secs;
+extern volatile unsigned int ms_ticks;
+
+//Power-managed modes of the simulated PIC
+typedef enum { POWER_RUN, POWER_IDLE, POWER_SLEEP } POWER_STATE;
+
+//Per-function statistics, in the order functions are first called
+typedef struct {
+    void *fn;
+    unsigned long long calls;
+    unsigned long long cycles;
+    unsigned long long best, worst, total;  //Cycles per call, including callees but not pre-empting ISRs (for -B)
+} FUNC_STATS;
+
+//Worst-case cycle budget of a function, read from the budget file
+typedef struct {
+    char name[64];
+    unsigned long long cycles;
+} BUDGET;
+
+//16-bit timer with the TMRxCON layout shared by Timer1 and Timer3 (TMRxON bit 0, TMRxCS bit 1, TxCKPS bits 4-5)
+typedef struct {
+    volatile unsigned char *con, *low, *high;
+    volatile unsigned char *flag;           //Overflow interrupt flag register & bit
+    unsigned char flag_mask;
+    unsigned long prescale_count;
+    unsigned long long phase;               //Fractional crystal tick accumulator, in units of 1/(fcy * 10^6) crystal ticks
+    unsigned long long overflow_cycles;     //Cycle at which it last overflowed
+} TIMER16;
+
+//CCP module, described by its control & compare registers and its interrupt flag
+typedef struct {
+    volatile unsigned char *con;
+    volatile CCPR_t *ccpr;
+    volatile unsigned char *flag;
+    unsigned char flag_mask;
+} COMPARE;
+
+//Interrupt source, described by its flag, enable and priority bits
+typedef struct {
+    volatile unsigned char *flag, *enable, *priority;
+    unsigned char flag_mask, enable_mask, priority_mask;
+    char peripheral;                        //Gated by PEIE when priorities are disabled
+} INT_SOURCE;
+
+//EUSART, described by its registers & the bits of its interrupt flags, and the state of its shift registers & receive FIFO
+typedef struct {
+    volatile unsigned char *txsta, *rcsta, *baudcon, *spbrg, *spbrgh, *txreg, *rcreg, *pir;
+    unsigned char txif, rcif;               //Masks of TXxIF & RCxIF in *pir
+    int (*receive)(unsigned char *b);       //Returns 1 with the next byte on the line once one has come in, 0 if none has. NULL if nothing is connected
+    int fd;                                 //Where bytes sent go, or -1 if they are discarded
+    unsigned char fifo[UART_FIFO];          //Bytes received, waiting to be read from RCREGx
+    int fifo_count;
+    int txreg_full;                         //Set when TXREGx holds a byte the shift register hasn't taken yet
+    unsigned char tsr;                      //Byte being shifted out, and the cycle at which it has been sent (0 if none is)
+    unsigned long long tsr_end;
+    unsigned long long rx_next;             //Cycle at which the line is next checked for a received byte
+    unsigned long long rx_bytes, tx_bytes;
+} EUSART;
+
+//Timed input event read from the events file
+typedef struct {
+    unsigned long long cycle;
+    char input;
+    unsigned int value;
+} EVENT;
+
+//SFR storage for the stand-in device header
+volatile PORTA_t sfr_PORTA;
+volatile PORTB_t sfr_PORTB;
+volatile PORTC_t sfr_PORTC;
+volatile PORTH_t sfr_PORTH;
+volatile PORTJ_t sfr_PORTJ;
+volatile LATA_t sfr_LATA;
+volatile LATF_t sfr_LATF;
+volatile LATH_t sfr_LATH;
+volatile LATJ_t sfr_LATJ;
+volatile TRISA_t sfr_TRISA;
+volatile TRISB_t sfr_TRISB;
+volatile TRISC_t sfr_TRISC;
+volatile TRISF_t sfr_TRISF;
+volatile TRISH_t sfr_TRISH;
+volatile TRISJ_t sfr_TRISJ;
+volatile INTCON_t sfr_INTCON;
+volatile INTCON2_t sfr_INTCON2;
+volatile RCON_t sfr_RCON;
+volatile PIR1_t sfr_PIR1;
+volatile PIE1_t sfr_PIE1;
+volatile IPR1_t sfr_IPR1;
+volatile T0CON_t sfr_T0CON;
+volatile T1CON_t sfr_T1CON;
+volatile TMR0L_t sfr_TMR0L;
+volatile TMR0H_t sfr_TMR0H;
+volatile TMR1L_t sfr_TMR1L;
+volatile TMR1H_t sfr_TMR1H;
+volatile ADCON1_t sfr_ADCON1;
+volatile PIR2_t sfr_PIR2;
+volatile PIE2_t sfr_PIE2;
+volatile IPR2_t sfr_IPR2;
+volatile PIR3_t sfr_PIR3;
+volatile PIE3_t sfr_PIE3;
+volatile IPR3_t sfr_IPR3;
+volatile T3CON_t sfr_T3CON;
+volatile TMR3L_t sfr_TMR3L;
+volatile TMR3H_t sfr_TMR3H;
+volatile CCP4CON_t sfr_CCP4CON;
+volatile CCPR_t sfr_CCPR4;
+volatile CCP3CON_t sfr_CCP3CON;
+volatile CCPR_t sfr_CCPR3;
+volatile CCP5CON_t sfr_CCP5CON;
+volatile CCPR_t sfr_CCPR5;
+volatile OSCCON_t sfr_OSCCON;
+volatile HLVDCON_t sfr_HLVDCON;
+volatile EECON1_t sfr_EECON1;
+volatile EECON2_t sfr_EECON2;
+volatile EEADR_t sfr_EEADR;
+volatile EEADRH_t sfr_EEADRH;
+volatile EEDATA_t sfr_EEDATA;
+volatile TXSTA1_t sfr_TXSTA1;
+volatile RCSTA1_t sfr_RCSTA1;
+volatile BAUDCON1_t sfr_BAUDCON1;
+volatile SPBRG1_t sfr_SPBRG1;
+volatile SPBRGH1_t sfr_SPBRGH1;
+volatile TXREG1_t sfr_TXREG1;
+volatile RCREG1_t sfr_RCREG1;
+volatile TXSTA2_t sfr_TXSTA2;
+volatile RCSTA2_t sfr_RCSTA2;
+volatile BAUDCON2_t sfr_BAUDCON2;
+volatile SPBRG2_t sfr_SPBRG2;
+volatile SPBRGH2_t sfr_SPBRGH2;
+volatile TXREG2_t sfr_TXREG2;
+volatile RCREG2_t sfr_RCREG2;
+volatile INTCON3_t sfr_INTCON3;
+
+//Simulator state
+static unsigned long long fcy = 2500000ULL;        //Instruction clock (Fosc/4)
+static unsigned long long sim_cycles = 0;          //Instruction cycles elapsed since reset
+static unsigned long long end_cycles;              //Cycle at which the run stops
+static unsigned long long next_second;             //Cycle at which the next verbose report is due
+static unsigned int block_cycles = 4;
+static int verbose = 0;
+static long crystal_ppm = 0;                       //Error of the Timer1 crystal (-x)
+static unsigned long rtc_first, rtc_last;          //epoch_secs at the first (since the time was last set) & last RTC ticks seen, and the cycles at which they were seen
+static unsigned long long rtc_first_cycles, rtc_last_cycles;
+static int rtc_ticks = 0;
+static unsigned long long tick_count = 0, tick_sum = 0;    //No. & total length of the tick periods measured
+static unsigned long long tick_last_cycles = 0, tick_min = ~0ULL, tick_max = 0;    //Cycle of the last tick (0 = none since sleeping)
+static POWER_STATE power = POWER_RUN;
+static unsigned long long power_cycles[3];         //Cycles spent in each POWER_STATE
+static int displays_lit = 0;                       //Set when any display/the LEDs are enabled, for the verbose report
+static unsigned long long lit_cycles[3];           //Cycles for which the LEDs, U1 & U2 have been enabled
+static unsigned char eeprom[EE_SIZE];              //Data EEPROM contents
+static const char *eeprom_path = NULL;             //File it is loaded from & saved to (-E)
+static unsigned long long ee_write_end = 0;        //Cycle at which the write in progress finishes, or 0 if none is
+static unsigned int ee_write_addr;
+static unsigned char ee_write_data;
+static int supply_low = 0;                         //Set while the supply is below the HLVD trip point (HLVD event)
+static EUSART eusart1 = { &sfr_TXSTA1.byte, &sfr_RCSTA1.byte, &sfr_BAUDCON1.byte, &sfr_SPBRG1.byte, &sfr_SPBRGH1.byte, &sfr_TXREG1.byte,
+                          &sfr_RCREG1.byte, &sfr_PIR1.byte, 0x10, 0x20, NULL, -1 };
+static EUSART eusart2 = { &sfr_TXSTA2.byte, &sfr_RCSTA2.byte, &sfr_BAUDCON2.byte, &sfr_SPBRG2.byte, &sfr_SPBRGH2.byte, &sfr_TXREG2.byte,
+                          &sfr_RCREG2.byte, &sfr_PIR3.byte, 0x10, 0x20, NULL, -1 };
+static char *nmea_text = NULL;                     //NMEA sentences replayed from the -G file, with CR LF line ends
+static size_t nmea_size = 0;
+static size_t nmea_groups[MAX_NMEA_GROUPS + 1];    //Start of each second's group of sentences in nmea_text
+static long long nmea_group_epoch[MAX_NMEA_GROUPS];    //Epoch time each group names, or -1 if it has no RMC/ZDA with one
+static int n_nmea_groups = 0, nmea_group = 0;      //No. of groups, and the next to send
+static size_t nmea_pos = 0, nmea_end = 0;          //Part of nmea_text being sent, from cycle nmea_from
+static unsigned long long nmea_from = 0;
+static unsigned long long pps_next = 0, pps_fall = 0;  //Cycles of the next PPS rising & falling edges, or 0 if there is none
+static unsigned long pps_edges = 0, pps_locked = 0;    //PPS edges, and ones at which the RTC was within 0.5s of the GPS time
+static unsigned long pps_unlocked = 0;              //PPS edges in the second half of the run at which it wasn't
+static double pps_offset = 0.0, pps_worst = 0.0;   //(seconds) Offset of the RTC at the last of those, and the largest in the second half of the run
+static unsigned long long *radio_at = NULL;         //Cycle each level of the radio receiver's output (-R) starts at, and the level,
+static char *radio_level = NULL;                    //or 'M' for a minute mark, whose epoch time is in radio_epoch
+static unsigned long *radio_epoch = NULL;
+static int n_radio_runs = 0, radio_run = 0;         //No. of them, and the next
+static unsigned long radio_marks = 0, radio_locked = 0, radio_edges = 0;    //Minute marks, ones at which the RTC was within 0.5s, and edges
+static double radio_offset = 0.0, radio_worst = 0.0;    //(seconds) As pps_offset & pps_worst, at the minute marks
+static struct timespec wall_start;                 //Wall clock time at the start of the run, for pacing it (-U)
+
+static FUNC_STATS funcs[MAX_FUNCS];
+static int n_funcs = 0;
+static int stack[MAX_DEPTH];
+static unsigned long long stack_start[MAX_DEPTH], stack_preempted[MAX_DEPTH];  //sim_cycles & preempted when each call was made
+static int depth = 0;
+static unsigned long long preempted = 0;           //Total cycles spent in ISRs which pre-empted other code, including their latency
+static BUDGET budgets[MAX_BUDGETS];
+static int n_budgets = 0;
+static unsigned int entry_cycles = 0;              //Extra cycles to charge on the next function entry (interrupt latency)
+
+static unsigned long t0_prescale_count = 0;
+static TIMER16 timer1 = { &sfr_T1CON.byte, &sfr_TMR1L.byte, &sfr_TMR1H.byte, &sfr_PIR1.byte, 0x01 };
+static TIMER16 timer3 = { &sfr_T3CON.byte, &sfr_TMR3L.byte, &sfr_TMR3H.byte, &sfr_PIR2.byte, 0x02 };
+
+static const COMPARE compares[] = {
+    { &sfr_CCP3CON.byte, &sfr_CCPR3, &sfr_PIR3.byte, 0x01 },
+    { &sfr_CCP4CON.byte, &sfr_CCPR4, &sfr_PIR3.byte, 0x02 },
+    { &sfr_CCP5CON.byte, &sfr_CCPR5, &sfr_PIR3.byte, 0x04 },
+};
+
+static const INT_SOURCE int_sources[] = {
+    { &sfr_INTCON.byte, &sfr_INTCON.byte, NULL, 0x02, 0x10, 0x00, 0 },                  //INT0 (always high priority)
+    { &sfr_INTCON.byte, &sfr_INTCON.byte, &sfr_INTCON2.byte, 0x04, 0x20, 0x04, 0 },     //TMR0
+    { &sfr_PIR1.byte, &sfr_PIE1.byte, &sfr_IPR1.byte, 0x01, 0x01, 0x01, 1 },            //TMR1
+    { &sfr_PIR2.byte, &sfr_PIE2.byte, &sfr_IPR2.byte, 0x02, 0x02, 0x02, 1 },            //TMR3
+    { &sfr_PIR3.byte, &sfr_PIE3.byte, &sfr_IPR3.byte, 0x01, 0x01, 0x01, 1 },            //CCP3
+    { &sfr_PIR3.byte, &sfr_PIE3.byte, &sfr_IPR3.byte, 0x02, 0x02, 0x02, 1 },            //CCP4
+    { &sfr_PIR3.byte, &sfr_PIE3.byte, &sfr_IPR3.byte, 0x04, 0x04, 0x04, 1 },            //CCP5
+    { &sfr_PIR2.byte, &sfr_PIE2.byte, &sfr_IPR2.byte, 0x10, 0x10, 0x10, 1 },            //EEIF
+    { &sfr_PIR2.byte, &sfr_PIE2.byte, &sfr_IPR2.byte, 0x04, 0x04, 0x04, 1 },            //HLVD
+    { &sfr_PIR1.byte, &sfr_PIE1.byte, &sfr_IPR1.byte, 0x20, 0x20, 0x20, 1 },            //RC1
+    { &sfr_PIR1.byte, &sfr_PIE1.byte, &sfr_IPR1.byte, 0x10, 0x10, 0x10, 1 },            //TX1
+    { &sfr_PIR3.byte, &sfr_PIE3.byte, &sfr_IPR3.byte, 0x20, 0x20, 0x20, 1 },            //RC2
+    { &sfr_INTCON3.byte, &sfr_INTCON3.byte, &sfr_INTCON3.byte, 0x01, 0x08, 0x40, 0 },   //INT1
+};
+
+static char in_hp = 0, in_lp = 0;
+
+static EVENT events[MAX_EVENTS];
+static int n_events = 0, next_event = 0;
+
+static unsigned char seen_U1, seen_U2, seen_LEDS;  //Last values driven onto LATF while each display was enabled
+static unsigned char buzzer_last = 0;
+static unsigned long buzzer_cycles = 0;            //Buzzer square wave cycles in the current second
+
+static void SimAdvance(unsigned long long cycles);
+
+static int FindFunc(void *fn) {
+    int i;
+    for (i = 0; i < n_funcs; i++) {
+        if (funcs[i].fn == fn)
+            return(i);
+    }
+    if (n_funcs == MAX_FUNCS) {
+        fprintf(stderr, "sim: too many functions\n");
+        exit(2);
+    }
+    funcs[n_funcs].fn = fn;
+    return(n_funcs++);
+}
+
+static const char *FuncName(void *fn) {
+    Dl_info info;
+    if (fn == (void *)fw_main)
+        return("main");
+    if (dladdr(fn, &info) && info.dli_sname)
+        return(info.dli_sname);
+    return("?");
+}
+
+//Called by the compiler on entry/exit of every firmware function (-finstrument-functions)
+void __cyg_profile_func_enter(void *fn, void *call_site) {
+    int f = FindFunc(fn);
+    unsigned int cost = CALL_CYCLES + entry_cycles;
+    (void)call_site;
+    if (depth == MAX_DEPTH) {
+        fprintf(stderr, "sim: call stack overflow\n");
+        exit(2);
+    }
+    funcs[f].calls++;
+    stack_start[depth] = sim_cycles;
+    stack_preempted[depth] = preempted;
+    stack[depth++] = f;
+    entry_cycles = 0;
+    SimAdvance(cost);
+}
+
+void __cyg_profile_func_exit(void *fn, void *call_site) {
+    FUNC_STATS *f;
+    unsigned long long cycles;
+    (void)fn;
+    (void)call_site;
+    depth--;
+    f = &funcs[stack[depth]];
+    cycles = (sim_cycles - stack_start[depth]) - (preempted - stack_preempted[depth]);
+    if (f->total == 0 || cycles < f->best)
+        f->best = cycles;
+    if (cycles > f->worst)
+        f->worst = cycles;
+    f->total += cycles;
+}
+
+//Called by the compiler at the start of every basic block in the firmware (-fsanitize-coverage=trace-pc)
+void __sanitizer_cov_trace_pc(void) {
+    SimAdvance(block_cycles);
+}
+
+static unsigned long long Timer0CyclesToOverflow(void) {
+    unsigned long prescale = T0CONbits.PSA ? 1 : (2UL << T0CONbits.T0PS);
+    unsigned long value = T0CONbits.T08BIT ? (0x100UL - TMR0L) : (0x10000UL - ((TMR0H << 8) | TMR0L));
+    if (!T0CONbits.TMR0ON || T0CONbits.T0CS || power == POWER_SLEEP)
+        return(~0ULL);
+    return(value * prescale - t0_prescale_count);
+}
+
+static void Timer0Tick(unsigned long long cycles) {
+    unsigned long prescale = T0CONbits.PSA ? 1 : (2UL << T0CONbits.T0PS);
+    unsigned long long counts, value;
+    if (!T0CONbits.TMR0ON || T0CONbits.T0CS || power == POWER_SLEEP)
+        return;
+    counts = (t0_prescale_count + cycles) / prescale;
+    t0_prescale_count = (t0_prescale_count + cycles) % prescale;
+    if (T0CONbits.T08BIT) {
+        value = TMR0L + counts;
+        if (value > 0xFF)
+            INTCONbits.TMR0IF = 1;
+        TMR0L = value & 0xFF;
+    } else {
+        value = ((TMR0H << 8) | TMR0L) + counts;
+        if (value > 0xFFFF)
+            INTCONbits.TMR0IF = 1;
+        TMR0H = (value >> 8) & 0xFF;
+        TMR0L = value & 0xFF;
+    }
+}
+
+//True if the timer is counting. In sleep, only a timer counting the crystal without synchronising to the instruction clock does
+static int Timer16Running(const TIMER16 *t) {
+    if (!(*t->con & 0x01))
+        return(0);
+    return(power != POWER_SLEEP || ((*t->con & 0x02) && (*t->con & 0x04)));
+}
+
+static unsigned int Timer16Value(const TIMER16 *t) {
+    return((*t->high << 8) | *t->low);
+}
+
+//Crystal frequency including its error, in units of 10^-6 Hz
+static unsigned long long CrystalRate(void) {
+    return(CRYSTAL_HZ * (1000000 + crystal_ppm));
+}
+
+//Number of instruction cycles until the timer has counted another 'counts' times
+static unsigned long long Timer16CyclesToCounts(const TIMER16 *t, unsigned long long counts) {
+    unsigned long long ticks = counts * (1ULL << ((*t->con >> 4) & 0x03)) - t->prescale_count;
+    if (!Timer16Running(t))
+        return(~0ULL);
+    if (!(*t->con & 0x02))
+        return(ticks);
+    return((ticks * fcy * 1000000ULL - t->phase + CrystalRate() - 1) / CrystalRate());
+}
+
+//Advances the timer by 'cycles' instruction cycles and returns the number of times it counted
+static unsigned long long Timer16Tick(TIMER16 *t, unsigned long long cycles) {
+    unsigned long prescale = 1UL << ((*t->con >> 4) & 0x03);
+    unsigned long long ticks, counts, value;
+    if (!Timer16Running(t))
+        return(0);
+    if (*t->con & 0x02) {
+        t->phase += cycles * CrystalRate();
+        ticks = t->phase / (fcy * 1000000ULL);
+        t->phase %= fcy * 1000000ULL;
+    } else {
+        ticks = cycles;
+    }
+    counts = (t->prescale_count + ticks) / prescale;
+    t->prescale_count = (t->prescale_count + ticks) % prescale;
+    value = Timer16Value(t) + counts;
+    if (value > 0xFFFF) {
+        *t->flag |= t->flag_mask;
+        t->overflow_cycles = sim_cycles;
+    }
+    *t->high = (value >> 8) & 0xFF;
+    *t->low = value & 0xFF;
+    return(counts);
+}
+
+//Timer used as the timebase for a CCP module in compare mode, or NULL if the module isn't in compare mode
+static TIMER16 *CompareTimebase(const COMPARE *c) {
+    if ((*c->con & 0x0F) < 0x08 || (*c->con & 0x0F) > 0x0B)
+        return(NULL);
+    return((T3CONbits.T3CCP2 || T3CONbits.T3CCP1) ? &timer3 : &timer1);
+}
+
+//Number of counts of the timebase until it next equals the compare register (1 to 65536)
+static unsigned long CompareDistance(const COMPARE *c, const TIMER16 *t) {
+    unsigned long d = (c->ccpr->word - Timer16Value(t)) & 0xFFFF;
+    return(d ? d : 0x10000);
+}
+
+static unsigned long long CyclesToNextEvent(void) {
+    unsigned long long next = Timer0CyclesToOverflow(), limit;
+    unsigned int i;
+    TIMER16 *t;
+    const EUSART *u;
+    if ((limit = Timer16CyclesToCounts(&timer1, 0x10000UL - Timer16Value(&timer1))) < next)
+        next = limit;
+    if ((limit = Timer16CyclesToCounts(&timer3, 0x10000UL - Timer16Value(&timer3))) < next)
+        next = limit;
+    for (i = 0; i < sizeof(compares) / sizeof(compares[0]); i++) {
+        if ((t = CompareTimebase(&compares[i])) && (limit = Timer16CyclesToCounts(t, CompareDistance(&compares[i], t))) < next)
+            next = limit;
+    }
+    if (ee_write_end != 0 && ee_write_end - sim_cycles < next)
+        next = ee_write_end - sim_cycles;
+    for (i = 0; i < 2; i++) {
+        u = i ? &eusart2 : &eusart1;
+        if (!(*u->rcsta & 0x80))            //SPEN
+            continue;
+        if (u->tsr_end != 0 && u->tsr_end - sim_cycles < next)
+            next = u->tsr_end - sim_cycles;
+        if (u->receive && (u->rx_next <= sim_cycles || u->rx_next - sim_cycles < next))
+            next = (u->rx_next > sim_cycles) ? u->rx_next - sim_cycles : 0;
+    }
+    if (pps_next != 0 && pps_next - sim_cycles < next)
+        next = pps_next - sim_cycles;
+    if (pps_fall != 0 && pps_fall - sim_cycles < next)
+        next = pps_fall - sim_cycles;
+    if (radio_run < n_radio_runs && radio_at[radio_run] - sim_cycles < next)
+        next = (radio_at[radio_run] > sim_cycles) ? radio_at[radio_run] - sim_cycles : 0;
+    return(next);
+}
+
+//Advances Timer0, Timer1 & Timer3 and checks the CCP modules for compare matches
+static void TimersTick(unsigned long long cycles) {
+    unsigned long distance[sizeof(compares) / sizeof(compares[0])];
+    unsigned long long counts1, counts3, counts;
+    unsigned int i;
+    TIMER16 *t;
+    for (i = 0; i < sizeof(compares) / sizeof(compares[0]); i++) {
+        t = CompareTimebase(&compares[i]);
+        distance[i] = t ? CompareDistance(&compares[i], t) : 0;
+    }
+    Timer0Tick(cycles);
+    counts1 = Timer16Tick(&timer1, cycles);
+    counts3 = Timer16Tick(&timer3, cycles);
+    for (i = 0; i < sizeof(compares) / sizeof(compares[0]); i++) {
+        if (!(t = CompareTimebase(&compares[i])))
+            continue;
+        counts = (t == &timer3) ? counts3 : counts1;
+        if (counts >= distance[i]) {
+            *compares[i].flag |= compares[i].flag_mask;
+            if ((*compares[i].con & 0x0F) == 0x0B) {        //Special event trigger resets the timebase
+                *t->high = ((counts - distance[i]) >> 8) & 0xFF;
+                *t->low = (counts - distance[i]) & 0xFF;
+            }
+        }
+    }
+}
+
+//Returns true if an enabled interrupt source of the given priority (1 = high, 0 = low) is pending
+static int InterruptPending(int high) {
+    unsigned int i;
+    const INT_SOURCE *s;
+    for (i = 0; i < sizeof(int_sources) / sizeof(int_sources[0]); i++) {
+        s = &int_sources[i];
+        if (!(*s->flag & s->flag_mask) || !(*s->enable & s->enable_mask))
+            continue;
+        if (!RCONbits.IPEN) {
+            if (high && (!s->peripheral || INTCONbits.PEIE))
+                return(1);
+        } else if (!(s->priority ? (*s->priority & s->priority_mask) : 1) == !high) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+//Returns true if any interrupt source has both its flag & enable bits set, which wakes the PIC whether or not interrupts are enabled
+static int WakePending(void) {
+    unsigned int i;
+    for (i = 0; i < sizeof(int_sources) / sizeof(int_sources[0]); i++) {
+        if ((*int_sources[i].flag & int_sources[i].flag_mask) && (*int_sources[i].enable & int_sources[i].enable_mask))
+            return(1);
+    }
+    return(0);
+}
+
+//EEDATA. A read started by setting EECON1bits.RD is done when it is next accessed, which on the PIC is the next instruction
+volatile EEDATA_t *SimEEDATA(void) {
+    if (EECON1bits.RD) {
+        EECON1bits.RD = 0;
+        sfr_EEDATA.byte = eeprom[((EEADRH << 8) | EEADR) & (EE_SIZE - 1)];
+    }
+    return(&sfr_EEDATA);
+}
+
+//Starts an EEPROM write once EECON1bits.WR is set, latching the address & data as the PIC does, and finishes it EE_WRITE_MS later
+static void EepromTick(void) {
+    if (ee_write_end == 0 && EECON1bits.WR) {
+        ee_write_addr = ((EEADRH << 8) | EEADR) & (EE_SIZE - 1);
+        ee_write_data = sfr_EEDATA.byte;
+        ee_write_end = sim_cycles + fcy * EE_WRITE_MS / 1000;
+    } else if (ee_write_end != 0 && sim_cycles >= ee_write_end) {
+        eeprom[ee_write_addr] = ee_write_data;
+        ee_write_end = 0;
+        EECON1bits.WR = 0;
+        PIR2bits.EEIF = 1;
+    }
+}
+
+//HLVD. The reference is stable as soon as it is enabled, and the flag is set for as long as the supply is past the trip point in the
+//direction chosen by VDIRMAG, as it is on the PIC
+static void HlvdTick(void) {
+    HLVDCONbits.IRVST = HLVDCONbits.HLVDEN;
+    if (HLVDCONbits.HLVDEN && supply_low != HLVDCONbits.VDIRMAG)
+        PIR2bits.HLVDIF = 1;
+}
+
+//Instruction cycles taken to send or receive one byte (start bit, 8 data bits, stop bit) at the baud rate set
+static unsigned long long UartByteCycles(const EUSART *u) {
+    unsigned long divisor = (*u->baudcon & 0x08) ? ((*u->txsta & 0x04) ? 4 : 16) : ((*u->txsta & 0x04) ? 16 : 64);    //BRG16, BRGH
+    unsigned long brg = (*u->baudcon & 0x08) ? ((*u->spbrgh << 8) | *u->spbrg) : *u->spbrg;
+    return(10ULL * divisor * (brg + 1) / 4);
+}
+
+//TXREGx. Whatever the firmware writes is taken by the shift register on the next UartTick()
+volatile TXREG1_t *SimTXREG1(void) {
+    eusart1.txreg_full = 1;
+    *eusart1.pir &= ~eusart1.txif;
+    return(&sfr_TXREG1);
+}
+
+//RCREGx. Reading it takes the oldest byte from the FIFO, and RCxIF stays set while there is another
+static void UartRead(EUSART *u) {
+    if (u->fifo_count > 0) {
+        *u->rcreg = u->fifo[0];
+        memmove(u->fifo, u->fifo + 1, --u->fifo_count);
+    }
+    if (u->fifo_count > 0)
+        *u->pir |= u->rcif;
+    else
+        *u->pir &= ~u->rcif;
+}
+
+volatile RCREG1_t *SimRCREG1(void) {
+    UartRead(&eusart1);
+    return(&sfr_RCREG1);
+}
+
+volatile RCREG2_t *SimRCREG2(void) {
+    UartRead(&eusart2);
+    return(&sfr_RCREG2);
+}
+
+//Sends the byte in the shift register to fd once its time is up, then loads the next from TXREGx, and receives a byte from whatever is
+//connected each byte time. 'cycles' have just elapsed
+static void UartTick(EUSART *u, unsigned long long cycles) {
+    unsigned char b;
+    if (!(*u->rcsta & 0x80))                //SPEN
+        return;
+    if (power == POWER_SLEEP) {             //The baud rate generator stops with the oscillator, so the byte being sent is held up
+        if (u->tsr_end != 0)
+            u->tsr_end += cycles;
+    } else {
+        if (u->tsr_end != 0 && sim_cycles >= u->tsr_end) {
+            if (u->fd >= 0 && write(u->fd, &u->tsr, 1) == 1)
+                u->tx_bytes++;
+            u->tsr_end = 0;
+        }
+        if (u->tsr_end == 0 && u->txreg_full && (*u->txsta & 0x20)) {     //TXEN
+            u->tsr = *u->txreg;
+            u->txreg_full = 0;
+            u->tsr_end = sim_cycles + UartByteCycles(u);
+        }
+    }
+    if (u->tsr_end == 0)                    //TRMT
+        *u->txsta |= 0x02;
+    else
+        *u->txsta &= ~0x02;
+    if ((*u->txsta & 0x20) && !u->txreg_full)
+        *u->pir |= u->txif;
+    else
+        *u->pir &= ~u->txif;
+    if (!(*u->rcsta & 0x10))                //Clearing CREN clears OERR
+        *u->rcsta &= ~0x02;
+    if (u->receive && sim_cycles >= u->rx_next) {
+        u->rx_next = sim_cycles + UartByteCycles(u);
+        if (u->receive(&b)) {
+            u->rx_bytes++;
+            if (power == POWER_SLEEP) {         //Not received, but with WUE set its start bit wakes the PIC
+                if ((*u->baudcon & 0x02) && u->fifo_count < UART_FIFO) {
+                    *u->baudcon &= ~0x02;
+                    u->fifo[u->fifo_count++] = 0x00;
+                }
+            } else if ((*u->rcsta & 0x10) && !(*u->rcsta & 0x02)) {
+                if (u->fifo_count < UART_FIFO)
+                    u->fifo[u->fifo_count++] = b;
+                else
+                    *u->rcsta |= 0x02;          //OERR. Lost, and nothing more is received until CREN is cleared
+            }
+        }
+    }
+    if (u->fifo_count > 0)
+        *u->pir |= u->rcif;
+    else
+        *u->pir &= ~u->rcif;
+}
+
+static int PtyReceive(unsigned char *b) {
+    return(read(eusart1.fd, b, 1) == 1);
+}
+
+//Next byte of the NMEA sentences being replayed (-G), once the receiver has started sending them after the PPS
+static int NmeaReceive(unsigned char *b) {
+    if (nmea_pos >= nmea_end || sim_cycles < nmea_from)
+        return(0);
+    *b = nmea_text[nmea_pos++];
+    return(1);
+}
+
+//Epoch time (seconds from 00:00:00 01/01/2000) named by an RMC or ZDA sentence, or -1 if it isn't one or doesn't have a whole date & time
+static long long NmeaEpoch(const char *line) {
+    char copy[128], *fields[12], *p = copy;
+    int n = 0;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    snprintf(copy, sizeof(copy), "%s", line);
+    while (n < 12 && (fields[n] = strsep(&p, ",*")) != NULL)
+        n++;
+    if (n < 2 || strlen(fields[0]) != 6 || sscanf(fields[1], "%2d%2d%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3)
+        return(-1);
+    if (strcmp(fields[0] + 3, "RMC") == 0 && n > 9 && sscanf(fields[9], "%2d%2d%2d", &tm.tm_mday, &tm.tm_mon, &tm.tm_year) == 3)
+        tm.tm_year += 100;
+    else if (strcmp(fields[0] + 3, "ZDA") == 0 && n > 4 && sscanf(fields[2], "%d", &tm.tm_mday) == 1 && sscanf(fields[3], "%d", &tm.tm_mon) == 1 &&
+             sscanf(fields[4], "%d", &tm.tm_year) == 1)
+        tm.tm_year -= 1900;
+    else
+        return(-1);
+    tm.tm_mon--;
+    return((long long)timegm(&tm) - 946684800LL);
+}
+
+//Returns 1 if the sentence's checksum is good. Corrupt ones are still sent, but don't end a group or give its time
+static int NmeaValid(const char *line) {
+    unsigned char sum = 0;
+    unsigned int check;
+    const char *p;
+    for (p = line + 1; *p && *p != '*'; p++)
+        sum ^= *p;
+    return(*p == '*' && sscanf(p + 1, "%2X", &check) == 1 && check == sum);
+}
+
+//Reads the NMEA file for -G and splits it into the groups of sentences sent after each PPS. A group ends where a sentence names a
+//different time from the one before, or has the same type as one already in the group (so a receiver with no fix, which sends no time,
+//still gives one group a second). Lines not starting with '$' are left out, and each sentence is sent with CR LF
+static void LoadNmea(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[128], type[8] = "", types[256] = "", time[16], last_time[16] = "";
+    size_t len;
+    long long e;
+    int valid;
+    if (!fp) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] != '$')
+            continue;
+        len = strlen(line);
+        valid = NmeaValid(line);
+        snprintf(type, sizeof(type), "%.6s", valid ? line : "");
+        time[0] = 0;
+        if (strlen(type) == 6 && (strcmp(type + 3, "RMC") == 0 || strcmp(type + 3, "GGA") == 0 || strcmp(type + 3, "ZDA") == 0))
+            sscanf(line + 7, "%15[^,]", time);
+        if (n_nmea_groups == 0 || (type[0] && strstr(types, type)) || (time[0] && last_time[0] && strcmp(time, last_time) != 0)) {
+            if (n_nmea_groups == MAX_NMEA_GROUPS) {
+                fprintf(stderr, "%s: more than %d seconds of sentences, the rest are left out\n", path, MAX_NMEA_GROUPS);
+                break;
+            }
+            nmea_groups[n_nmea_groups] = nmea_size;
+            nmea_group_epoch[n_nmea_groups++] = -1;
+            types[0] = 0;
+            last_time[0] = 0;
+        }
+        strncat(types, type, sizeof(types) - strlen(types) - 1);
+        if (time[0])
+            snprintf(last_time, sizeof(last_time), "%s", time);
+        if (valid && (e = NmeaEpoch(line)) >= 0)
+            nmea_group_epoch[n_nmea_groups - 1] = e;
+        nmea_text = realloc(nmea_text, nmea_size + len + 2);
+        memcpy(nmea_text + nmea_size, line, len);
+        memcpy(nmea_text + nmea_size + len, "\r\n", 2);
+        nmea_size += len + 2;
+    }
+    fclose(fp);
+    nmea_groups[n_nmea_groups] = nmea_size;
+    pps_next = fcy;                         //The first PPS is 1s into the run
+    PORTBbits.RB1 = 0;
+    eusart2.receive = NmeaReceive;
+}
+
+//Returns the offset (seconds) of the RTC from true time, now being the start of second expect (epoch time), positive if it is ahead.
+//Measured from the Timer1 overflow which started the RTC's second, as that is when the firmware counted it
+static double RtcOffset(long long expect) {
+    unsigned long e = epoch_secs + (PIR1bits.TMR1IF ? 1 : 0);   //A second which has ended but not yet been counted by Timer1 ISR
+    return((double)e - expect + (double)(sim_cycles - timer1.overflow_cycles) / fcy);
+}
+
+//GPS receiver (-G). Raises the PPS on RB1 (INT1) at each whole second of the run, for PPS_WIDTH_MS, and starts sending the group of
+//sentences naming that second NMEA_DELAY_MS after it. The RTC's offset from the GPS time is measured at each PPS
+static void GpsTick(void) {
+    double offset;
+    if (pps_fall != 0 && sim_cycles >= pps_fall) {
+        if (PORTBbits.RB1 && !INTCON2bits.INTEDG1)
+            INTCON3bits.INT1IF = 1;
+        PORTBbits.RB1 = 0;
+        pps_fall = 0;
+    }
+    if (pps_next == 0 || sim_cycles < pps_next)
+        return;
+    if (nmea_group >= n_nmea_groups) {      //Out of sentences, so the receiver has gone (the RTC is left holding over)
+        pps_next = 0;
+        return;
+    }
+    if (!PORTBbits.RB1 && INTCON2bits.INTEDG1)
+        INTCON3bits.INT1IF = 1;
+    PORTBbits.RB1 = 1;
+    pps_fall = sim_cycles + fcy * PPS_WIDTH_MS / 1000;
+    if (nmea_group_epoch[nmea_group] >= 0) {
+        offset = RtcOffset(nmea_group_epoch[nmea_group]);
+        if (offset > -0.5 && offset < 0.5) {
+            pps_locked++;
+            pps_offset = offset;
+            if (sim_cycles >= end_cycles / 2 && fabs(offset) > pps_worst)
+                pps_worst = fabs(offset);
+        } else if (sim_cycles >= end_cycles / 2) {
+            pps_unlocked++;
+        }
+    }
+    pps_edges++;
+    nmea_pos = nmea_groups[nmea_group];
+    nmea_end = nmea_groups[++nmea_group];
+    nmea_from = sim_cycles + fcy * NMEA_DELAY_MS / 1000;
+    pps_next += fcy;
+}
+
+//Reads the radio time-code file for -R. Each line is "<level> <ms>", RB2 held at level (0/1) for ms, or "M <epoch>", where the minute
+//which starts there (epoch time, seconds since 00:00:00 01/01/2000) starts. The first level starts at the start of the run
+static void LoadRadio(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[128], level;
+    unsigned long long ms = 0;
+    unsigned long v;
+    if (!fp) {
+        perror(path);
+        exit(2);
+    }
+    radio_at = malloc(MAX_RADIO_RUNS * sizeof(*radio_at));
+    radio_level = malloc(MAX_RADIO_RUNS);
+    radio_epoch = malloc(MAX_RADIO_RUNS * sizeof(*radio_epoch));
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, " %c %lu", &level, &v) != 2)
+            continue;
+        if (n_radio_runs == MAX_RADIO_RUNS) {
+            fprintf(stderr, "%s: more than %d lines, the rest are left out\n", path, MAX_RADIO_RUNS);
+            break;
+        }
+        radio_at[n_radio_runs] = fcy * ms / 1000;
+        radio_level[n_radio_runs] = level;
+        radio_epoch[n_radio_runs++] = v;
+        if (level != 'M')
+            ms += v;
+    }
+    fclose(fp);
+}
+
+//Radio time-code receiver (-R). Sets RB2 to each level in the file in turn, and measures the RTC's offset from true time at each minute mark
+static void RadioTick(void) {
+    double offset;
+    for (; radio_run < n_radio_runs && sim_cycles >= radio_at[radio_run]; radio_run++) {
+        if (radio_level[radio_run] != 'M') {
+            if (PORTBbits.RB2 != (radio_level[radio_run] == '1'))
+                radio_edges++;
+            PORTBbits.RB2 = (radio_level[radio_run] == '1');
+            continue;
+        }
+        radio_marks++;
+        offset = RtcOffset(radio_epoch[radio_run]);
+        if (offset > -0.5 && offset < 0.5) {
+            radio_locked++;
+            radio_offset = offset;
+            if (sim_cycles >= end_cycles / 2 && fabs(offset) > radio_worst)
+                radio_worst = fabs(offset);
+        }
+    }
+}
+
+//Creates the pseudo-terminal for -U. The slave end is held open, so that clients can come & go without the master reading EOF
+static int OpenUart(void) {
+    struct termios tio;
+    const char *name;
+    int slave, fd;
+    if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || !(name = ptsname(fd)) ||
+        (slave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+        perror("pseudo-terminal");
+        return(0);
+    }
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    eusart1.fd = fd;
+    eusart1.receive = PtyReceive;
+    fprintf(stderr, "EUSART1 on %s\n", name);
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    return(1);
+}
+
+//With -U, waits for the wall clock to catch up whenever the run has got more than PACE_SLACK_NS ahead of it
+static void Pace(void) {
+    struct timespec now, wait;
+    long long ahead;
+    if (eusart1.fd < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ahead = (long long)(sim_cycles * 1000000000.0 / fcy) - ((now.tv_sec - wall_start.tv_sec) * 1000000000LL + (now.tv_nsec - wall_start.tv_nsec));
+    if (ahead > PACE_SLACK_NS) {
+        wait.tv_sec = ahead / 1000000000LL;
+        wait.tv_nsec = ahead % 1000000000LL;
+        nanosleep(&wait, NULL);
+    }
+}
+
+static void LoadEeprom(void) {
+    FILE *fp;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (eeprom_path && (fp = fopen(eeprom_path, "rb"))) {
+        if (fread(eeprom, 1, sizeof(eeprom), fp) != sizeof(eeprom))
+            fprintf(stderr, "%s: shorter than %d bytes, the rest is erased\n", eeprom_path, EE_SIZE);
+        fclose(fp);
+    }
+}
+
+static void SaveEeprom(void) {
+    FILE *fp;
+    if (!eeprom_path)
+        return;
+    if (!(fp = fopen(eeprom_path, "wb")) || fwrite(eeprom, 1, sizeof(eeprom), fp) != sizeof(eeprom))
+        perror(eeprom_path);
+    if (fp)
+        fclose(fp);
+}
+
+//Latch whatever is on LATF into the display/LEDs currently selected by the multiplexing lines, count the cycles it has been lit for
+//(the last 'cycles'), and count buzzer cycles
+static void SampleOutputs(unsigned long long cycles) {
+    if (LATHbits.LH0 || LATHbits.LH1)
+        displays_lit = 1;
+    if (LATHbits.LH0 && LATHbits.LH1 && LATAbits.LA4) {
+        seen_LEDS = LATF;
+        lit_cycles[0] += cycles;
+    } else if (!LATHbits.LH0 && LATHbits.LH1 && !LATAbits.LA4) {
+        seen_U1 = LATF;
+        lit_cycles[1] += cycles;
+    } else if (LATHbits.LH0 && !LATHbits.LH1 && !LATAbits.LA4) {
+        seen_U2 = LATF;
+        lit_cycles[2] += cycles;
+    }
+    if (LATJbits.LATJ6 && !buzzer_last)
+        buzzer_cycles++;
+    buzzer_last = LATJbits.LATJ6;
+}
+
+static void ApplyEvent(const EVENT *e) {
+    switch (e->input) {
+        case('1'):
+            PORTJbits.RJ5 = e->value ? 0 : 1;       //Push buttons are active-low
+            break;
+        case('2'):
+            if (PORTBbits.RB0 == (e->value ? 1 : 0) && INTCON2bits.INTEDG0 == (e->value ? 0 : 1))
+                INTCONbits.INT0IF = 1;                  //PB2 is on INT0, which a falling (INTEDG0 clear) or rising edge sets
+            PORTBbits.RB0 = e->value ? 0 : 1;
+            break;
+        case('S'):
+            PORTC = (PORTC & 0xC3) | ((e->value & 0x0F) << 2);
+            PORTH = (PORTH & 0x0F) | (e->value & 0xF0);
+            break;
+        case('V'):
+            supply_low = e->value ? 1 : 0;
+            break;
+    }
+}
+
+//Print a 7-segment pattern as the digit it shows, or as hex if it isn't a digit
+static void PrintSegments(unsigned char seg) {
+    int i;
+    for (i = 0; i < 10; i++) {
+        if ((unsigned char)DispNums[i] == (seg | 0x04)) {
+            printf(" %d", i);
+            return;
+        }
+    }
+    printf(" 0x%02X", seg);
+}
+
+static void Report(void) {
+    double secs = (double)sim_cycles / fcy;
+    unsigned long long total = 0;
+    int order[MAX_FUNCS];
+    int i, j, t;
+    for (i = 0; i < n_funcs; i++) {
+        order[i] = i;
+        total += funcs[i].cycles;
+    }
+    for (i = 1; i < n_funcs; i++) {
+        for (j = i; j > 0 && funcs[order[j]].cycles > funcs[order[j - 1]].cycles; j--) {
+            t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+    printf("Simulated %.3f s, Fcy %llu Hz, %u cycles per basic block\n", secs, fcy, block_cycles);
+    if (rtc_last_cycles > rtc_first_cycles) {
+        double elapsed = (double)(rtc_last_cycles - rtc_first_cycles) / fcy;
+        printf("RTC counted %lu s in %.6f s (%+.1f ppm), crystal %+ld ppm\n", rtc_last - rtc_first, elapsed,
+               1e6 * ((rtc_last - rtc_first) - elapsed) / elapsed, crystal_ppm);
+    }
+    printf("Awake %.2f%%, idle %.2f%%, asleep %.2f%% of the time\n", 100.0 * power_cycles[POWER_RUN] / sim_cycles,
+           100.0 * power_cycles[POWER_IDLE] / sim_cycles, 100.0 * power_cycles[POWER_SLEEP] / sim_cycles);
+    printf("LEDs lit %.2f%%, U1 %.2f%%, U2 %.2f%% of the time\n", 100.0 * lit_cycles[0] / sim_cycles,
+           100.0 * lit_cycles[1] / sim_cycles, 100.0 * lit_cycles[2] / sim_cycles);
+    if (tick_count > 0) {
+        printf("1ms tick period %.3f us average, %.3f us shortest, %.3f us longest (%llu ticks)\n",
+               1e6 * tick_sum / tick_count / fcy, 1e6 * tick_min / fcy, 1e6 * tick_max / fcy, tick_count);
+    }
+    if (eusart1.fd >= 0)
+        printf("EUSART1 received %llu bytes, sent %llu bytes\n", eusart1.rx_bytes, eusart1.tx_bytes);
+    if (n_nmea_groups > 0) {
+        printf("GPS %lu PPS, %lu with the RTC within 0.5s: %+.3f ms at the last, %.3f ms at worst in the second half of the run (%llu NMEA bytes)\n",
+               pps_edges, pps_locked, 1e3 * pps_offset, 1e3 * pps_worst, eusart2.rx_bytes);
+    }
+    if (n_radio_runs > 0) {
+        printf("Radio %lu minute marks, %lu with the RTC within 0.5s: %+.3f ms at the last, %.3f ms at worst in the second half of the run (%lu edges)\n",
+               radio_marks, radio_locked, 1e3 * radio_offset, 1e3 * radio_worst, radio_edges);
+    }
+    printf("%-24s %12s %14s %7s\n", "Function", "Calls/s", "Cycles/s", "CPU %");
+    for (i = 0; i < n_funcs; i++) {
+        FUNC_STATS *f = &funcs[order[i]];
+        printf("%-24s %12.1f %14.1f %7.2f\n", FuncName(f->fn), f->calls / secs, f->cycles / secs,
+               total ? 100.0 * f->cycles / total : 0.0);
+    }
+}
+
+//Prints the best/average/worst cycles per call of each function in the budget file. Returns the no. of functions over budget or not called,
+//plus one if the RTC lost (or never got) lock to the GPS replay in the second half of the run
+static int Bench(void) {
+    int i, j, failed = 0;
+    FUNC_STATS *f;
+    if (n_budgets == 0)
+        return(0);
+    printf("\n%-24s %10s %8s %10s %8s %8s\n", "Function", "Calls", "Best", "Average", "Worst", "Budget");
+    for (i = 0; i < n_budgets; i++) {
+        f = NULL;
+        for (j = 0; j < n_funcs; j++) {
+            if (strcmp(FuncName(funcs[j].fn), budgets[i].name) == 0)
+                f = &funcs[j];
+        }
+        if (!f || f->calls == 0) {
+            printf("%-24s %10s %8s %10s %8s %8llu  FAIL (not called)\n", budgets[i].name, "-", "-", "-", "-", budgets[i].cycles);
+            failed++;
+            continue;
+        }
+        printf("%-24s %10llu %8llu %10.1f %8llu %8llu  %s\n", budgets[i].name, f->calls, f->best, (double)f->total / f->calls, f->worst,
+               budgets[i].cycles, f->worst > budgets[i].cycles ? "FAIL" : "ok");
+        if (f->worst > budgets[i].cycles)
+            failed++;
+    }
+    if (n_nmea_groups > 0) {
+        printf("%-24s %10lu PPS in the second half of the run with the RTC 0.5s or more from the GPS  %s\n", "GPS lock", pps_unlocked,
+               pps_unlocked > 0 ? "FAIL" : "ok");
+        if (pps_unlocked > 0)
+            failed++;
+    }
+    return(failed);
+}
+
+static void SimAdvance(unsigned long long cycles) {
+    unsigned long long step, limit, entry, hp_preempted;
+    unsigned int ticks;
+    while (cycles > 0) {
+        step = cycles;
+        if ((limit = CyclesToNextEvent()) < step)
+            step = limit;
+        if (next_event < n_events && events[next_event].cycle - sim_cycles < step)
+            step = events[next_event].cycle - sim_cycles;
+        if (end_cycles - sim_cycles < step)
+            step = end_cycles - sim_cycles;
+        if (step == 0)
+            step = 1;
+        cycles -= step;
+
+        sim_cycles += step;
+        power_cycles[power] += step;
+        if (depth > 0 && power == POWER_RUN)
+            funcs[stack[depth - 1]].cycles += step;
+        TimersTick(step);
+        EepromTick();
+        HlvdTick();
+        GpsTick();
+        RadioTick();
+        UartTick(&eusart1, step);
+        UartTick(&eusart2, step);
+        SampleOutputs(step);
+        Pace();
+
+        while (next_event < n_events && events[next_event].cycle <= sim_cycles)
+            ApplyEvent(&events[next_event++]);
+        if (verbose && sim_cycles >= next_second) {
+            printf("[%6llu s] U2/U1:", sim_cycles / fcy);
+            if (displays_lit) {
+                PrintSegments(seen_U2);
+                PrintSegments(seen_U1);
+                printf("  LEDs: 0x%02X  Buzzer: %lu Hz\n", seen_LEDS, buzzer_cycles);
+            } else {
+                printf(" blank\n");
+            }
+            buzzer_cycles = 0;
+            displays_lit = 0;
+            next_second += fcy;
+        }
+        if (sim_cycles >= end_cycles) {
+            Report();
+            SaveEeprom();
+            exit(Bench() ? 1 : 0);
+        }
+
+        //While idle/asleep, run on until something wakes the PIC, then return to SimSleep() to wake it before any ISR is called
+        if (power != POWER_RUN) {
+            if (WakePending())
+                return;
+            continue;
+        }
+
+        //Interrupt controller. ISRs are called from here, so they run on top of whatever the firmware was doing
+        if (!in_hp && INTCONbits.GIE && InterruptPending(1)) {
+            entry = sim_cycles;
+            in_hp = 1;
+            entry_cycles = ISR_LATENCY_CYCLES;
+            hp_secs_count_isr();
+            in_hp = 0;
+            preempted += sim_cycles - entry;
+            if (epoch_secs != rtc_last) {
+                if (epoch_secs != rtc_last + 1 || timer1.overflow_cycles == rtc_last_cycles) {
+                    rtc_ticks = 0;                  //The firmware has set the time, maybe mid-second, so measure again from the next overflow
+                } else if (rtc_ticks++ == 0) {
+                    rtc_first = epoch_secs;
+                    rtc_first_cycles = timer1.overflow_cycles;
+                }
+                rtc_last = epoch_secs;
+                rtc_last_cycles = timer1.overflow_cycles;
+            }
+        }
+        if (!in_hp && !in_lp && RCONbits.IPEN && INTCONbits.GIE && INTCONbits.PEIE && InterruptPending(0)) {
+            ticks = ms_ticks;
+            entry = sim_cycles;
+            hp_preempted = preempted;
+            in_lp = 1;
+            entry_cycles = ISR_LATENCY_CYCLES;
+            lp_isr();
+            in_lp = 0;
+            preempted += (sim_cycles - entry) - (preempted - hp_preempted);    //hp_secs_count_isr pre-empting it has already been counted
+            if (ms_ticks != ticks) {
+                if (tick_last_cycles != 0) {
+                    tick_count++;
+                    tick_sum += entry - tick_last_cycles;
+                    if (entry - tick_last_cycles < tick_min)
+                        tick_min = entry - tick_last_cycles;
+                    if (entry - tick_last_cycles > tick_max)
+                        tick_max = entry - tick_last_cycles;
+                }
+                tick_last_cycles = entry;
+            }
+        }
+    }
+}
+
+//SLEEP instruction. Idles or sleeps (OSCCONbits.IDLEN) until an enabled interrupt flag is set. The ISR, if interrupts are enabled, is
+//called from the firmware's next basic block, as it would be vectored to on the PIC once it has woken
+void SimSleep(void) {
+    power = OSCCONbits.IDLEN ? POWER_IDLE : POWER_SLEEP;
+    while (!WakePending())
+        SimAdvance(~0ULL);
+    if (power == POWER_SLEEP) {             //Only the asynchronous timers count while the oscillator starts up again
+        sim_cycles += OST_CYCLES;
+        power_cycles[POWER_SLEEP] += OST_CYCLES;
+        TimersTick(OST_CYCLES);
+        tick_last_cycles = 0;               //The tick stopped while asleep, so don't count the gap as a tick period
+    }
+    power = POWER_RUN;
+}
+
+//Charge a peripheral library routine to its own entry in the report
+static void LibCall(void *fn, unsigned long long cycles) {
+    __cyg_profile_func_enter(fn, NULL);
+    SimAdvance(cycles);
+    __cyg_profile_func_exit(fn, NULL);
+}
+
+void WriteTimer0(unsigned int timer0) {
+    LibCall((void *)WriteTimer0, 4);
+    TMR0H = timer0 >> 8;
+    TMR0L = timer0 & 0xFF;
+}
+
+void WriteTimer1(unsigned int timer1) {
+    LibCall((void *)WriteTimer1, 4);
+    TMR1H = timer1 >> 8;
+    TMR1L = timer1 & 0xFF;
+}
+
+void WriteTimer3(unsigned int timer3) {
+    LibCall((void *)WriteTimer3, 4);
+    TMR3H = timer3 >> 8;
+    TMR3L = timer3 & 0xFF;
+}
+
+unsigned int ReadTimer0(void) {
+    LibCall((void *)ReadTimer0, 4);
+    return((TMR0H << 8) | TMR0L);
+}
+
+unsigned int ReadTimer1(void) {
+    LibCall((void *)ReadTimer1, 4);
+    return((TMR1H << 8) | TMR1L);
+}
+
+unsigned int ReadTimer3(void) {
+    LibCall((void *)ReadTimer3, 4);
+    return((TMR3H << 8) | TMR3L);
+}
+
+void Delay1TCY(void) {
+    SimAdvance(1);
+}
+
+void Delay10TCYx(unsigned char unit) {
+    LibCall((void *)Delay10TCYx, 10ULL * (unit ? unit : 256));
+}
+
+void Delay100TCYx(unsigned char unit) {
+    LibCall((void *)Delay100TCYx, 100ULL * (unit ? unit : 256));
+}
+
+void Delay1KTCYx(unsigned char unit) {
+    LibCall((void *)Delay1KTCYx, 1000ULL * (unit ? unit : 256));
+}
+
+void Delay10KTCYx(unsigned char unit) {
+    LibCall((void *)Delay10KTCYx, 10000ULL * (unit ? unit : 256));
+}
+
+static void LoadEvents(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[128], name[16];
+    double ms;
+    unsigned int value;
+    if (!fp) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%lf %15s %i", &ms, name, (int *)&value) != 3 || n_events == MAX_EVENTS) {
+            fprintf(stderr, "%s: bad event: %s", path, line);
+            exit(2);
+        }
+        events[n_events].cycle = (unsigned long long)(ms * fcy / 1000.0);
+        events[n_events].input = strcmp(name, "PB1") == 0 ? '1' : strcmp(name, "PB2") == 0 ? '2' : strcmp(name, "SW") == 0 ? 'S' :
+                                 strcmp(name, "HLVD") == 0 ? 'V' : 0;
+        events[n_events].value = value;
+        if (!events[n_events].input) {
+            fprintf(stderr, "%s: unknown input %s\n", path, name);
+            exit(2);
+        }
+        if (n_events > 0 && events[n_events].cycle < events[n_events - 1].cycle) {
+            fprintf(stderr, "%s: events must be in time order\n", path);
+            exit(2);
+        }
+        n_events++;
+    }
+    fclose(fp);
+}
+
+static void LoadBudgets(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[128];
+    if (!fp) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (n_budgets == MAX_BUDGETS || sscanf(line, "%63s %llu", budgets[n_budgets].name, &budgets[n_budgets].cycles) != 2) {
+            fprintf(stderr, "%s: bad budget: %s", path, line);
+            exit(2);
+        }
+        n_budgets++;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char **argv) {
+    double seconds = 10.0;
+    const char *events_path = NULL, *budgets_path = NULL, *nmea_path = NULL, *radio_path = NULL;
+    int i, uart = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            fcy = strtoull(argv[++i], NULL, 0) / 4;
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+            crystal_ppm = strtol(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            block_cycles = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            events_path = argv[++i];
+        else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc)
+            eeprom_path = argv[++i];
+        else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc)
+            budgets_path = argv[++i];
+        else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc)
+            nmea_path = argv[++i];
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            radio_path = argv[++i];
+        else if (strcmp(argv[i], "-U") == 0)
+            uart = 1;
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = 1;
+        else {
+            fprintf(stderr, "usage: %s [-t seconds] [-f fosc_hz] [-x crystal_ppm] [-b cycles_per_block] [-e events_file] [-E eeprom_file] [-G nmea_file] [-R radio_file] [-B budget_file] [-U] [-v]\n", argv[0]);
+            return(2);
+        }
+    }
+    if (events_path)
+        LoadEvents(events_path);
+    if (budgets_path)
+        LoadBudgets(budgets_path);
+    LoadEeprom();
+    if (uart && !OpenUart())
+        return(1);
+    end_cycles = (unsigned long long)(seconds * fcy);
+    next_second = fcy;
+
+    //Reset state of the inputs: push buttons released (pulled high), toggle switches off
+    PORTB = 0xFF;
+    PORTJ = 0xFF;
+    PORTC = 0x00;
+    PORTH = 0x00;
+    if (nmea_path)
+        LoadNmea(nmea_path);
+    if (radio_path)
+        LoadRadio(radio_path);
+
+    fw_main();
+    return(0);
+}